@@ -23,15 +23,34 @@
 
  #define QUERY_HOOK_INIT(HEAD, HOOK)    .HEAD = &HOOK
 
+/*
+ * A flow as seen by asynchronous observers: a copy of the relation and of the
+ * node fields shared by every node type (short or long) of its end nodes.
+ * The relation is not yet stamped (see "Ordering" in provenance.h).
+ */
+struct provenance_flow {
+	struct node_struct from;
+	union prov_elt edge;
+	struct node_struct to;
+};
+
 struct provenance_query_hooks {
 	struct list_head list;
 	int (*flow)(prov_entry_t *, prov_entry_t *, prov_entry_t *);
 	int (*alloc)(prov_entry_t *);
 	int (*free)(prov_entry_t *);
+	/*
+	 * Optional asynchronous observer. Receives batches of flows, in the
+	 * order they were recorded on a CPU, from a workqueue outside any
+	 * provenance lock. Cannot prevent flows, must not sleep. Flows are
+	 * dropped when a CPU buffer is full (see provenance_observe_dropped).
+	 */
+	void (*observe)(const struct provenance_flow *, size_t);
 };
 
 extern struct list_head provenance_query_hooks;
 
 int register_provenance_query_hooks( struct provenance_query_hooks *hook);
 int unregister_provenance_query_hooks( struct provenance_query_hooks *hook);
+uint64_t provenance_observe_dropped(void);
 #endif
@@ -60,9 +60,18 @@
 #define prov_flag(prov)                         ((prov)->msg_info.internal_flag)
 #define prov_taint(prov)                        ((prov)->msg_info.taint)
 #define prov_jiffies(prov)                      ((prov)->msg_info.jiffies)
+#define prov_ts(prov)                           ((prov)->msg_info.ts)
+#define prov_cpu(prov)                          ((prov)->msg_info.cpu)
+#define prov_seq(prov)                          ((prov)->msg_info.seq)
 
 #define provenance_taint_merge(dest, src) dest = (dest) | (src)
 
+/*
+ * Node and relation ids are unique for a given (boot_id, machine_id) and
+ * never 0. They are handed out to each CPU in blocks: ids allocated on a
+ * CPU increase, but ids do not reflect the order of allocation across CPUs
+ * and are not contiguous. Order entries with ts/seq (see "Ordering").
+ */
 struct node_identifier {
 	uint64_t type;
 	uint64_t id;
@@ -137,9 +146,34 @@ union prov_identifier {
 #define clear_saved(node)                       prov_clear_flag(node, SAVED_BIT)
 #define provenance_is_saved(node)               prov_check_flag(node, SAVED_BIT)
 
+/* Entry replayed from the boot buffer, see "Ordering" below. */
+#define REPLAYED_BIT            7
+#define set_replayed(node)                      prov_set_flag(node, REPLAYED_BIT)
+#define clear_replayed(node)                    prov_clear_flag(node, REPLAYED_BIT)
+#define provenance_is_replayed(node)            prov_check_flag(node, REPLAYED_BIT)
 
-
-#define basic_elements          union prov_identifier identifier; uint32_t epoch; uint32_t nepoch; uint32_t internal_flag; uint64_t jiffies; uint64_t taint
+/*
+ * Ordering.
+ *
+ * Every entry is stamped when it is handed over to relay with:
+ * - ts: CLOCK_MONOTONIC time in nanoseconds;
+ * - cpu: the CPU that recorded the entry;
+ * - seq: a per-CPU counter (shared by regular and long entries) that wraps
+ *   at 2^32.
+ * Within each per-CPU file of a channel (regular or long, relay or shared
+ * channel), entries appear in increasing seq order (modulo 2^32), hence in
+ * non-decreasing ts order. A consumer obtains a total order consistent with
+ * the order in which entries were recorded by k-way merging the per-CPU
+ * files of a channel on (ts, cpu, seq), holding only the head entry of each
+ * file. Gaps in seq are entries the channel did not get (filtered or
+ * dropped).
+ * The exception are entries recorded before relay was ready, which are
+ * replayed from the boot buffer (provenance_is_replayed) into arbitrary
+ * per-CPU files once relay is ready. They are ordered by seq for a given
+ * cpu, and are merged separately (there are at most the size of the boot
+ * buffer of them, see provenance_boot=).
+ */
+#define basic_elements          union prov_identifier identifier; uint32_t epoch; uint32_t nepoch; uint32_t internal_flag; uint64_t jiffies; uint64_t taint; uint64_t ts; uint32_t cpu; uint32_t seq
 #define shared_node_elements    uint64_t previous_id; uint64_t previous_type; uint32_t k_version; uint32_t secid; uint32_t uid; uint32_t gid; void *var_ptr
 
 struct msg_struct {
@@ -157,6 +191,14 @@ struct relation_struct {
 	int64_t offset;
 	uint64_t flags;
 	uint64_t task_id;
+	/*
+	 * Aggregated relations (see the "aggregate" securityfs file) stand
+	 * for "count" occurrences between first_ts and last_ts (see ts), count
+	 * is 0 otherwise.
+	 */
+	uint32_t count;
+	uint64_t first_ts;
+	uint64_t last_ts;
 };
 
 struct node_struct {
@@ -291,6 +333,32 @@ struct arg_struct {
 	uint8_t truncated;
 };
 
+/*
+ * Packed arguments and environment of an exec (ENT_ARGS).
+ * The strings of an exec are spread over as few entries as possible, each
+ * entry carrying strings first to first + count - 1 (arguments come before
+ * environment strings, a string is an argument if its index is below argc).
+ * "value" holds a table of count uint16_t offsets (from the start of
+ * "value") followed by the NUL-terminated strings; "length" bytes are used.
+ * "truncated" is set if a string was too long to fit in an entry.
+ */
+#define PROV_ARGS_SIZE (PATH_MAX - 16)
+
+struct args_struct {
+	basic_elements;
+	shared_node_elements;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t first;
+	uint32_t count;
+	uint8_t truncated;
+	size_t length;
+	char value[PROV_ARGS_SIZE];
+};
+
+#define prov_args_offset(elt, i)        (((const uint16_t *)(elt)->args_info.value)[i])
+#define prov_args_string(elt, i)        ((elt)->args_info.value + prov_args_offset(elt, i))
+
 struct disc_node_struct {
 	basic_elements;
 	shared_node_elements;
@@ -335,6 +403,7 @@ union long_prov_elt {
 	struct str_struct str_info;
 	struct file_name_struct file_name_info;
 	struct arg_struct arg_info;
+	struct args_struct args_info;
 	struct address_struct address_info;
 	struct pckcnt_struct pckcnt_info;
 	struct disc_node_struct disc_node_info;
@@ -343,4 +412,369 @@ union long_prov_elt {
 };
 
 typedef union long_prov_elt prov_entry_t;
+
+/*
+ * Variable-length form of long provenance entries.
+ *
+ * When enabled (provenance_varlen=1 on the kernel command line) long channels
+ * carry, instead of sizeof(union long_prov_elt) bytes per entry:
+ * - struct prov_long_header;
+ * - the first var_off bytes of the structure;
+ * - the bytes following the variable field (struct_len - var_off - var_cap);
+ * - var_len bytes of the variable field (e.g., file_name_struct.name).
+ * Entries are padded to "len" bytes, a multiple of 8.
+ * The entry identifier therefore immediately follows the header.
+ * Omitted bytes of the variable field are zero once decoded.
+ */
+#define PROV_LONG_MAGIC    0x70766C31 /* never the low bits of a long type */
+
+struct prov_long_header {
+	uint32_t magic;
+	uint32_t len;
+	uint16_t struct_len;
+	uint16_t var_off;
+	uint16_t var_cap;
+	uint16_t var_len;
+};
+
+#define prov_long_is_varlen(buf)        (((struct prov_long_header *)(buf))->magic == PROV_LONG_MAGIC)
+
+/*
+ * Decode a variable-length long entry.
+ * Returns the number of bytes consumed from buf, or -1 if buf does not
+ * start with a valid encoded entry.
+ */
+static inline int prov_long_decode(const void *buf, size_t size,
+				   union long_prov_elt *elt)
+{
+	const struct prov_long_header *hdr = (const struct prov_long_header *)buf;
+	const uint8_t *src = (const uint8_t *)(hdr + 1);
+	uint8_t *dst = (uint8_t *)elt;
+	size_t tail;
+
+	if (size < sizeof(struct prov_long_header)
+	    || hdr->magic != PROV_LONG_MAGIC
+	    || hdr->len > size)
+		return -1;
+	tail = hdr->var_off + hdr->var_cap;
+	if (hdr->struct_len > sizeof(union long_prov_elt)
+	    || tail > hdr->struct_len
+	    || hdr->var_len > hdr->var_cap
+	    || sizeof(struct prov_long_header) + hdr->struct_len
+	    - hdr->var_cap + hdr->var_len > hdr->len)
+		return -1;
+	memset(elt, 0, sizeof(union long_prov_elt));
+	memcpy(dst, src, hdr->var_off);
+	src += hdr->var_off;
+	memcpy(dst + tail, src, hdr->struct_len - tail);
+	src += hdr->struct_len - tail;
+	memcpy(dst + hdr->var_off, src, hdr->var_len);
+	return hdr->len;
+}
+
+/*
+ * Compact relation stream.
+ *
+ * Channels in compact mode (provenance_compact=1 on the kernel command line
+ * for the base channel, "compact=1" when creating a channel) carry a byte
+ * stream instead of sizeof(union prov_elt) entries:
+ * - every relay sub-buffer (every read(2) on shared channels) starts with a
+ *   struct prov_compact_header, which resets the decoding state;
+ * - each entry is a struct prov_compact_record followed by "len" - 4 bytes.
+ * If PROV_C_RAW is set a complete union prov_elt follows (nodes, or relations
+ * that would not compress), otherwise a relation is delta-encoded against
+ * the previous compact relation of the stream. Fields appear in the order
+ * of the flags below; "always" fields are present in every compact record.
+ * Integers are LEB128 varints, signed deltas are zigzag encoded and raw
+ * fields are copied in host byte order.
+ * A header is recognised by its magic, whose low 16 bits can not be a
+ * record length.
+ */
+#define PROV_COMPACT_MAGIC      0x7063FFFF
+#define PROV_COMPACT_VERSION    3
+
+struct prov_compact_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t boot_id;
+	uint32_t machine_id;
+};
+
+struct prov_compact_record {
+	uint16_t len;
+	uint16_t fields;
+};
+
+#define PROV_C_TYPE             0x0001  /* raw type, otherwise previous type */
+#define PROV_C_RID              0x0002  /* raw boot_id and machine_id, otherwise header ones */
+/* always: relation id delta */
+#define PROV_C_EPOCH            0x0004  /* epoch, otherwise previous epoch */
+#define PROV_C_MISC             0x0008  /* nepoch, internal_flag, taint, allowed */
+/* always: jiffies delta, ts delta, seq delta */
+#define PROV_C_SND_RAW          0x0010  /* raw identifier */
+#define PROV_C_SND_TYPE         0x0020  /* raw type, otherwise previous type */
+/* always unless raw: sender id delta */
+#define PROV_C_SND_VER          0x0040  /* version, otherwise previous version */
+#define PROV_C_RCV_RAW          0x0080
+#define PROV_C_RCV_TYPE         0x0100
+/* always unless raw: receiver id delta */
+#define PROV_C_RCV_VER          0x0200
+#define PROV_C_FILE             0x0400  /* set, offset; otherwise 0 */
+#define PROV_C_FLAGS            0x0800  /* flags, otherwise previous flags */
+#define PROV_C_TASK             0x1000  /* task_id delta, otherwise previous task_id */
+#define PROV_C_CPU              0x2000  /* cpu, otherwise previous cpu */
+#define PROV_C_AGG              0x4000  /* count, ts - first_ts, ts - last_ts; otherwise 0 */
+#define PROV_C_RAW              0x8000
+
+#define PROV_COMPACT_MAX        (sizeof(struct prov_compact_record) + sizeof(union prov_elt))
+
+struct prov_compact_state {
+	uint32_t boot_id;
+	uint32_t machine_id;
+	union prov_elt prev;
+};
+
+#define prov_zigzag(v)          ((((uint64_t)(v)) << 1) ^ (uint64_t)(((int64_t)(v)) >> 63))
+#define prov_unzigzag(v)        (((v) >> 1) ^ (~((v) & 1) + 1))
+
+static inline uint8_t *prov_put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static inline const uint8_t *prov_get_varint(const uint8_t *p,
+					     const uint8_t *end,
+					     uint64_t *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= ((uint64_t)(*p & 0x7f)) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+#define prov_compact_is_header(buf)     (((struct prov_compact_header *)(buf))->magic == PROV_COMPACT_MAGIC)
+
+/*
+ * Reset the decoding state from a stream header.
+ * Returns the number of bytes consumed, or -1.
+ */
+static inline int prov_compact_read_header(struct prov_compact_state *st,
+					   const void *buf, size_t size)
+{
+	const struct prov_compact_header *hdr = (const struct prov_compact_header *)buf;
+
+	if (size < sizeof(struct prov_compact_header)
+	    || hdr->magic != PROV_COMPACT_MAGIC
+	    || hdr->version != PROV_COMPACT_VERSION)
+		return -1;
+	memset(st, 0, sizeof(struct prov_compact_state));
+	st->boot_id = hdr->boot_id;
+	st->machine_id = hdr->machine_id;
+	return sizeof(struct prov_compact_header);
+}
+
+static inline const uint8_t *__prov_compact_get_id(const uint8_t *p,
+						   const uint8_t *end,
+						   uint16_t fields,
+						   uint16_t raw_bit,
+						   uint16_t type_bit,
+						   uint16_t ver_bit,
+						   const struct prov_compact_state *st,
+						   union prov_identifier *id,
+						   const union prov_identifier *prev)
+{
+	uint64_t v;
+
+	if (fields & raw_bit) {
+		if (end - p < PROV_IDENTIFIER_BUFFER_LENGTH)
+			return NULL;
+		memcpy(id, p, PROV_IDENTIFIER_BUFFER_LENGTH);
+		return p + PROV_IDENTIFIER_BUFFER_LENGTH;
+	}
+	memset(id, 0, sizeof(union prov_identifier));
+	id->node_id.type = prev->node_id.type;
+	if (fields & type_bit) {
+		if (end - p < sizeof(uint64_t))
+			return NULL;
+		memcpy(&id->node_id.type, p, sizeof(uint64_t));
+		p += sizeof(uint64_t);
+	}
+	p = prov_get_varint(p, end, &v);
+	if (!p)
+		return NULL;
+	id->node_id.id = prev->node_id.id + prov_unzigzag(v);
+	id->node_id.version = prev->node_id.version;
+	if (fields & ver_bit) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return NULL;
+		id->node_id.version = (uint32_t)v;
+	}
+	id->node_id.boot_id = st->boot_id;
+	id->node_id.machine_id = st->machine_id;
+	return p;
+}
+
+/*
+ * Decode the record at the start of buf (which must not be a header).
+ * Returns the number of bytes consumed, or -1.
+ */
+static inline int prov_compact_decode(struct prov_compact_state *st,
+				      const void *buf, size_t size,
+				      union prov_elt *elt)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	const uint8_t *end;
+	struct prov_compact_record rec;
+	struct relation_struct *rel = &elt->relation_info;
+	const struct relation_struct *prev = &st->prev.relation_info;
+	uint64_t v;
+
+	if (size < sizeof(struct prov_compact_record))
+		return -1;
+	memcpy(&rec, p, sizeof(struct prov_compact_record));
+	if (rec.len < sizeof(struct prov_compact_record) || rec.len > size)
+		return -1;
+	end = p + rec.len;
+	p += sizeof(struct prov_compact_record);
+	if (rec.fields & PROV_C_RAW) {
+		if (end - p != sizeof(union prov_elt))
+			return -1;
+		memcpy(elt, p, sizeof(union prov_elt));
+		return rec.len;
+	}
+	memset(elt, 0, sizeof(union prov_elt));
+	rel->identifier.relation_id.type = prev->identifier.relation_id.type;
+	if (rec.fields & PROV_C_TYPE) {
+		if (end - p < sizeof(uint64_t))
+			return -1;
+		memcpy(&rel->identifier.relation_id.type, p, sizeof(uint64_t));
+		p += sizeof(uint64_t);
+	}
+	rel->identifier.relation_id.boot_id = st->boot_id;
+	rel->identifier.relation_id.machine_id = st->machine_id;
+	if (rec.fields & PROV_C_RID) {
+		if (end - p < 2 * sizeof(uint32_t))
+			return -1;
+		memcpy(&rel->identifier.relation_id.boot_id, p, sizeof(uint32_t));
+		memcpy(&rel->identifier.relation_id.machine_id,
+		       p + sizeof(uint32_t), sizeof(uint32_t));
+		p += 2 * sizeof(uint32_t);
+	}
+	p = prov_get_varint(p, end, &v);
+	if (!p)
+		return -1;
+	rel->identifier.relation_id.id = prev->identifier.relation_id.id + prov_unzigzag(v);
+	rel->epoch = prev->epoch;
+	if (rec.fields & PROV_C_EPOCH) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->epoch = (uint32_t)v;
+	}
+	rel->nepoch = prev->nepoch;
+	rel->internal_flag = prev->internal_flag;
+	rel->taint = prev->taint;
+	rel->allowed = prev->allowed;
+	if (rec.fields & PROV_C_MISC) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->nepoch = (uint32_t)v;
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->internal_flag = (uint32_t)v;
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->taint = v;
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->allowed = (uint8_t)v;
+	}
+	p = prov_get_varint(p, end, &v);
+	if (!p)
+		return -1;
+	rel->jiffies = prev->jiffies + prov_unzigzag(v);
+	p = prov_get_varint(p, end, &v);
+	if (!p)
+		return -1;
+	rel->ts = prev->ts + prov_unzigzag(v);
+	p = prov_get_varint(p, end, &v);
+	if (!p)
+		return -1;
+	rel->seq = prev->seq + (uint32_t)prov_unzigzag(v);
+	p = __prov_compact_get_id(p, end, rec.fields, PROV_C_SND_RAW,
+				  PROV_C_SND_TYPE, PROV_C_SND_VER, st,
+				  &rel->snd, &prev->snd);
+	if (!p)
+		return -1;
+	p = __prov_compact_get_id(p, end, rec.fields, PROV_C_RCV_RAW,
+				  PROV_C_RCV_TYPE, PROV_C_RCV_VER, st,
+				  &rel->rcv, &prev->rcv);
+	if (!p)
+		return -1;
+	if (rec.fields & PROV_C_FILE) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->set = (uint8_t)v;
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->offset = (int64_t)prov_unzigzag(v);
+	}
+	rel->flags = prev->flags;
+	if (rec.fields & PROV_C_FLAGS) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->flags = v;
+	}
+	rel->task_id = prev->task_id;
+	if (rec.fields & PROV_C_TASK) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->task_id = prev->task_id + prov_unzigzag(v);
+	}
+	rel->cpu = prev->cpu;
+	if (rec.fields & PROV_C_CPU) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->cpu = (uint32_t)v;
+	}
+	if (rec.fields & PROV_C_AGG) {
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->count = (uint32_t)v;
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->first_ts = rel->ts - prov_unzigzag(v);
+		p = prov_get_varint(p, end, &v);
+		if (!p)
+			return -1;
+		rel->last_ts = rel->ts - prov_unzigzag(v);
+	}
+	if (p != end)
+		return -1;
+	memcpy(&st->prev, elt, sizeof(union prov_elt));
+	return rec.len;
+}
 #endif
@@ -25,6 +25,7 @@
  #define PROV_WRITTEN_FILE                       "/sys/kernel/security/provenance/written"
  #define PROV_COMPRESS_NODE_FILE                 "/sys/kernel/security/provenance/compress_node"
  #define PROV_COMPRESS_EDGE_FILE                 "/sys/kernel/security/provenance/compress_edge"
+ #define PROV_PACK_ARGS_FILE                     "/sys/kernel/security/provenance/pack_args"
  #define PROV_NODE_FILE                          "/sys/kernel/security/provenance/node"
  #define PROV_RELATION_FILE                      "/sys/kernel/security/provenance/relation"
  #define PROV_SELF_FILE                          "/sys/kernel/security/provenance/self"
@@ -58,6 +59,12 @@
  #define PROV_CHANNEL                            "/sys/kernel/security/provenance/channel"
  #define PROV_DUPLICATE_FILE                     "/sys/kernel/security/provenance/duplicate"
  #define PROV_EPOCH_FILE                         "/sys/kernel/security/provenance/epoch"
+ #define PROV_RING_FILE                          "/sys/kernel/security/provenance/ring"
+ #define PROV_OVERFLOW_FILE                      "/sys/kernel/security/provenance/overflow"
+ #define PROV_DROPPED_FILE                       "/sys/kernel/security/provenance/dropped"
+ #define PROV_AGGREGATE_FILE                     "/sys/kernel/security/provenance/aggregate"
+ #define PROV_TARGET_CACHE_FILE                  "/sys/kernel/security/provenance/target_cache"
+ #define PROV_OBSERVE_FILE                       "/sys/kernel/security/provenance/observe"
 
  #define PROV_RELAY_NAME                         "/sys/kernel/debug/provenance"
  #define PROV_LONG_RELAY_NAME                    "/sys/kernel/debug/long_provenance"
@@ -122,4 +129,124 @@ struct nsinfo {
 	uint8_t op;
 	uint64_t taint;
 };
+
+/*
+ * Per-CPU staging ring statistics, times are in nanoseconds.
+ * "boot_overflow" counts entries recorded before relay was ready that did
+ * not fit in the boot buffer, "boot_depth" and "boot_drained" report the
+ * progress of the boot buffer drain.
+ */
+struct prov_ring_info {
+	uint32_t cpu;
+	uint32_t size;
+	uint32_t depth;
+	uint32_t max_depth;
+	uint32_t long_size;
+	uint32_t long_depth;
+	uint32_t long_max_depth;
+	uint64_t drained;
+	uint64_t overflow;
+	uint64_t drain_latency;
+	uint64_t max_drain_latency;
+	uint64_t drain_duration;
+	uint64_t max_drain_duration;
+	uint64_t boot_overflow;
+	uint64_t long_boot_overflow;
+	uint32_t boot_depth;
+	uint32_t long_boot_depth;
+	uint64_t boot_drained;
+	uint64_t long_boot_drained;
+};
+
+ #define PROV_CHANNEL_NAME_LEN    256
+
+/*
+ * Channel information, read from PROV_CHANNEL.
+ * Shared channels (the default, unless "shared=0" or relay sizes are given)
+ * read the per-CPU shared logs through cursors, "lost" counts the entries
+ * that were overwritten before the channel read them.
+ * For other channels, "lost" counts the entries dropped because the relay
+ * buffer was full.
+ * "varlen" channels carry long entries in variable-length form (see
+ * prov_long_decode in provenance.h), "compact" channels carry regular
+ * entries as a compact stream (see prov_compact_decode in provenance.h).
+ * The relay buffer geometry (per CPU) is 0 for shared channels.
+ * "filtered" channels only get the entries passing their capture filter.
+ */
+struct prov_channel_info {
+	char name[PROV_CHANNEL_NAME_LEN];
+	uint8_t shared;
+	uint8_t varlen;
+	uint8_t compact;
+	uint64_t lost;
+	uint64_t long_lost;
+	uint64_t subbuf_size;
+	uint64_t nb_subbuf;
+	uint64_t long_subbuf_size;
+	uint64_t long_nb_subbuf;
+	uint8_t filtered;
+};
+
+/*
+ * Policy applied when relay buffers are full, read from and written to
+ * PROV_OVERFLOW_FILE.
+ * PROV_OVERFLOW_DROP: the newest entries are dropped (and counted, see
+ * struct prov_drop_info).
+ * PROV_OVERFLOW_THROTTLE: best effort, fewer entries are dropped but drops
+ * remain possible. Staged entries are held back instead of being dropped,
+ * and tasks are throttled at the start of a hook (before any provenance lock
+ * is taken) for up to "wait_ms" while the staging rings of their CPU are
+ * more than half full. Entries themselves are written under node locks and
+ * are never delayed: when the ring is full, the oldest staged entry is
+ * forced to relay (and dropped if relay is full) as under PROV_OVERFLOW_DROP.
+ * Without CONFIG_PREEMPT_COUNT nothing waits.
+ * "wait_ms" cannot exceed PROV_OVERFLOW_MAX_WAIT_MS (-EINVAL).
+ */
+ #define PROV_OVERFLOW_DROP            0
+ #define PROV_OVERFLOW_THROTTLE        1
+
+ #define PROV_OVERFLOW_MAX_WAIT_MS     1000
+
+struct prov_overflow_policy {
+	uint8_t mode;
+	uint32_t wait_ms;
+};
+
+/*
+ * Entries dropped because a relay buffer was full, read from
+ * PROV_DROPPED_FILE. One element per type with at least one drop.
+ */
+struct prov_drop_info {
+	uint64_t type;
+	uint64_t count;
+};
+
+/*
+ * Aggregation of repeated relations, read from and written to
+ * PROV_AGGREGATE_FILE. Repetitions of a relation within "window_ms" of its
+ * first occurrence are emitted as one relation with a count (see
+ * struct relation_struct). 0 disables aggregation.
+ */
+struct prov_aggregate_policy {
+	uint32_t window_ms;
+};
+
+/*
+ * PROV_TARGET_CACHE_FILE. Lookups of the cached capture policy decision of a
+ * node (see the ns, secctx, user and group filters), and the current policy
+ * generation (bumped by every filter write).
+ */
+struct prov_target_cache_info {
+	uint64_t hits;
+	uint64_t misses;
+	uint32_t generation;
+};
+
+/*
+ * PROV_OBSERVE_FILE. Flows dropped because the buffer of a CPU was full
+ * before the asynchronous observers were called (see provenance_query.h).
+ */
+struct prov_observe_info {
+	uint64_t dropped;
+};
  #endif
@@ -68,6 +68,7 @@
 #define RL_PCK_CNT                              (RL_DERIVED   | (0x0000000000000001ULL << 18))
 #define RL_ADDRESSED                            (RL_DERIVED   | (0x0000000000000001ULL << 19))
 #define RL_DERIVED_DISC                         (RL_DERIVED   | (0x0000000000000001ULL << 20))
+#define RL_ARGS                                 (RL_DERIVED   | (0x0000000000000001ULL << 21))
 /* no more than 51!!!! */
 
 /* GENERATED SUBTYPES */
@@ -211,6 +212,7 @@
 #define ENT_ENV                                 (DM_ENTITY | ND_LONG | (0x0000000000000001ULL << 26))
 /* DISCLOSED TYPE */
 #define ENT_DISC                                (DM_ENTITY | ND_LONG | (0x0000000000000001ULL << 27))
+#define ENT_ARGS                                (DM_ENTITY | ND_LONG | (0x0000000000000001ULL << 28))
 
 #define prov_type(prov)                 ((prov)->node_info.identifier.node_id.type)
 #define node_type(node)                 prov_type(node)
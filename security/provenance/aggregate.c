@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2020 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+
+/*!
+ * Aggregation of repeated relations.
+ *
+ * When an aggregation window is set (see the "aggregate" securityfs file),
+ * relations recorded through record_relation are held back in a table
+ * keyed by their destination node. The relations pending for a node form a
+ * small table of recent (source, relation type) pairs: a repeated flow from
+ * the same version of the source to the same version of the destination
+ * only increments the count of the pending relation. A flow from a newer
+ * version of the source is a new relation.
+ * A pending relation is emitted, carrying its count and the time of its
+ * first and last occurrence, when:
+ * 1. the window (counted from the first occurrence) expires;
+ * 2. the destination changes version or is freed (see prov_aggregate_flush);
+ * 3. its slot is needed for a newer relation of the same bucket.
+ * Nodes hold no aggregation state, the table does not reference them.
+ */
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "provenance.h"
+#include "provenance_relay.h"
+#include "provenance_aggregate.h"
+
+struct prov_agg_bucket {
+	spinlock_t lock;
+	// Pending relations, a slot is free when its type is 0.
+	union prov_elt slot[PROV_AGG_SLOTS];
+};
+
+// Allocated when aggregation is first enabled, never freed.
+static struct prov_agg_bucket *agg_table;
+// Serialises changes of the window.
+static DEFINE_MUTEX(agg_lock);
+
+static void prov_aggregate_expire(struct work_struct *work);
+static DECLARE_DELAYED_WORK(agg_work, prov_aggregate_expire);
+
+static __always_inline struct prov_agg_bucket *agg_bucket(uint64_t id)
+{
+	// Pairs with release in prov_aggregate_set_window.
+	struct prov_agg_bucket *table = smp_load_acquire(&agg_table);
+
+	if (unlikely(!table))
+		return NULL;
+	return &table[hash_64(id, ilog2(PROV_AGG_BUCKETS))];
+}
+
+static __always_inline uint64_t agg_window(void)
+{
+	return (uint64_t)READ_ONCE(prov_policy.aggregate_window)
+	       * NSEC_PER_MSEC;
+}
+
+/*!
+ * @brief Emit a pending relation and free its slot.
+ *
+ * Called with the bucket lock held.
+ */
+static void agg_emit(union prov_elt *relation)
+{
+	prov_write(relation, sizeof(union prov_elt));
+	prov_type(relation) = 0;
+}
+
+static __always_inline bool agg_match(const union prov_elt *relation,
+				      uint64_t type,
+				      prov_entry_t *from,
+				      prov_entry_t *to)
+{
+	const struct relation_struct *rel = &relation->relation_info;
+
+	return prov_type(relation) == type
+	       && !memcmp(&rel->snd, &get_prov_identifier(from),
+			  PROV_IDENTIFIER_BUFFER_LENGTH)
+	       && !memcmp(&rel->rcv, &get_prov_identifier(to),
+			  PROV_IDENTIFIER_BUFFER_LENGTH);
+}
+
+/*!
+ * @brief Count an occurrence of a relation if it is pending.
+ *
+ * A pending relation whose window has expired is emitted instead.
+ * @param type The type of the relation.
+ * @param from The source node.
+ * @param to The destination node.
+ * @return true if the occurrence was counted (nothing else must be
+ * recorded), false if the relation must be recorded.
+ *
+ */
+bool prov_aggregate_hit(uint64_t type, prov_entry_t *from, prov_entry_t *to)
+{
+	struct prov_agg_bucket *b = agg_bucket(node_identifier(to).id);
+	uint64_t now = ktime_get_mono_fast_ns();
+	union prov_elt *relation;
+	unsigned long irqflags;
+	bool rc = false;
+	int i;
+
+	if (!b)
+		return false;
+	spin_lock_irqsave(&b->lock, irqflags);
+	for (i = 0; i < PROV_AGG_SLOTS; i++) {
+		relation = &b->slot[i];
+		if (!agg_match(relation, type, from, to))
+			continue;
+		if (now - relation->relation_info.first_ts >= agg_window()) {
+			agg_emit(relation);
+			break;
+		}
+		relation->relation_info.count++;
+		relation->relation_info.last_ts = now;
+		rc = true;
+		break;
+	}
+	spin_unlock_irqrestore(&b->lock, irqflags);
+	return rc;
+}
+
+/*!
+ * @brief Hold back a relation that has just been prepared.
+ *
+ * If the bucket is full, its oldest pending relation is emitted to make
+ * room. If aggregation has been disabled, the relation is emitted
+ * immediately.
+ * @param relation The relation (see __prepare_relation).
+ *
+ */
+void prov_aggregate_insert(union prov_elt *relation)
+{
+	struct prov_agg_bucket *b =
+		agg_bucket(relation->relation_info.rcv.node_id.id);
+	union prov_elt *victim = NULL;
+	unsigned long irqflags;
+	int i;
+
+	relation->relation_info.count = 1;
+	relation->relation_info.first_ts = ktime_get_mono_fast_ns();
+	relation->relation_info.last_ts = relation->relation_info.first_ts;
+	if (!b) {
+		prov_write(relation, sizeof(union prov_elt));
+		return;
+	}
+	spin_lock_irqsave(&b->lock, irqflags);
+	// Tested under the lock, see prov_aggregate_set_window.
+	if (!agg_window()) {
+		prov_write(relation, sizeof(union prov_elt));
+		goto out;
+	}
+	for (i = 0; i < PROV_AGG_SLOTS; i++) {
+		if (!prov_type(&b->slot[i])) {
+			victim = &b->slot[i];
+			break;
+		}
+		if (!victim || b->slot[i].relation_info.first_ts
+		    < victim->relation_info.first_ts)
+			victim = &b->slot[i];
+	}
+	if (prov_type(victim))
+		agg_emit(victim);
+	__memcpy_ss(victim, sizeof(union prov_elt),
+		    relation, sizeof(union prov_elt));
+out:
+	spin_unlock_irqrestore(&b->lock, irqflags);
+}
+
+/*!
+ * @brief Emit the relations pending for a node.
+ *
+ * Called before the node changes version or is freed, so that pending
+ * relations are emitted before the node's next version.
+ * @param node The destination node.
+ *
+ */
+void prov_aggregate_flush(prov_entry_t *node)
+{
+	struct prov_agg_bucket *b = agg_bucket(node_identifier(node).id);
+	union prov_elt *relation;
+	unsigned long irqflags;
+	int i;
+
+	if (!b)
+		return;
+	spin_lock_irqsave(&b->lock, irqflags);
+	for (i = 0; i < PROV_AGG_SLOTS; i++) {
+		relation = &b->slot[i];
+		if (prov_type(relation)
+		    && relation->relation_info.rcv.node_id.id
+		    == node_identifier(node).id)
+			agg_emit(relation);
+	}
+	spin_unlock_irqrestore(&b->lock, irqflags);
+}
+
+/*!
+ * @brief Emit the pending relations whose window has expired (or every
+ * pending relation if aggregation is disabled).
+ */
+static void agg_expire(void)
+{
+	uint64_t window = agg_window();
+	uint64_t now = ktime_get_mono_fast_ns();
+	union prov_elt *relation;
+	unsigned long irqflags;
+	int i, j;
+
+	for (i = 0; i < PROV_AGG_BUCKETS; i++) {
+		spin_lock_irqsave(&agg_table[i].lock, irqflags);
+		for (j = 0; j < PROV_AGG_SLOTS; j++) {
+			relation = &agg_table[i].slot[j];
+			if (prov_type(relation)
+			    && (!window || now - relation->relation_info.first_ts
+				>= window))
+				agg_emit(relation);
+		}
+		spin_unlock_irqrestore(&agg_table[i].lock, irqflags);
+		cond_resched();
+	}
+}
+
+static void prov_aggregate_expire(struct work_struct *work)
+{
+	uint32_t window_ms = READ_ONCE(prov_policy.aggregate_window);
+
+	if (!window_ms)
+		return;
+	agg_expire();
+	queue_delayed_work(system_unbound_wq, &agg_work,
+			   msecs_to_jiffies(window_ms));
+}
+
+/*!
+ * @brief Set the aggregation window.
+ *
+ * The table is allocated the first time aggregation is enabled. When
+ * aggregation is disabled, every pending relation is emitted.
+ * @param window_ms The window in milliseconds, 0 to disable aggregation.
+ * @return 0 or -ENOMEM.
+ *
+ */
+int prov_aggregate_set_window(uint32_t window_ms)
+{
+	struct prov_agg_bucket *table;
+	int rc = 0;
+	int i;
+
+	mutex_lock(&agg_lock);
+	if (window_ms && !agg_table) {
+		table = vzalloc(array_size(PROV_AGG_BUCKETS,
+					   sizeof(struct prov_agg_bucket)));
+		if (!table) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < PROV_AGG_BUCKETS; i++)
+			spin_lock_init(&table[i].lock);
+		smp_store_release(&agg_table, table);
+	}
+	WRITE_ONCE(prov_policy.aggregate_window, window_ms);
+	if (window_ms) {
+		mod_delayed_work(system_unbound_wq, &agg_work,
+				 msecs_to_jiffies(window_ms));
+	} else if (agg_table) {
+		cancel_delayed_work_sync(&agg_work);
+		// Inserts that raced with the update see the window under the
+		// bucket lock.
+		agg_expire();
+	}
+	pr_info("Provenance: aggregation window %u ms.", window_ms);
+out:
+	mutex_unlock(&agg_lock);
+	return rc;
+}
@@ -27,6 +27,7 @@
 #include "provenance_net.h"
 #include "provenance_task.h"
 #include "provenance_machine.h"
+#include "provenance_aggregate.h"
 #include "memcpy_ss.h"
 
 #define TMPBUFLEN    12
@@ -114,6 +115,147 @@ declare_file_operations(prov_all_ops, prov_write_all, prov_read_all);
 declare_read_flag_fcn(prov_read_written, prov_written);
 declare_file_operations(prov_written_ops, no_write, prov_read_written);
 
+static ssize_t prov_read_dropped(struct file *filp, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct prov_drop_info *info;
+	ssize_t rc;
+
+	if (count < sizeof(struct prov_drop_info))
+		return -ENOMEM;
+
+	info = kcalloc(PROV_DROP_SLOTS, sizeof(struct prov_drop_info),
+		       GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+
+	rc = prov_drop_info(info, min_t(size_t, PROV_DROP_SLOTS,
+					count / sizeof(struct prov_drop_info)));
+	rc *= sizeof(struct prov_drop_info);
+	if (copy_to_user(buf, info, rc))
+		rc = -EAGAIN;
+	kfree(info);
+	return rc;
+}
+declare_file_operations(prov_dropped_ops, no_write, prov_read_dropped);
+
+static ssize_t prov_write_overflow(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct prov_overflow_policy policy;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	if (count < sizeof(struct prov_overflow_policy))
+		return -ENOMEM;
+
+	if (copy_from_user(&policy, buf, sizeof(struct prov_overflow_policy)))
+		return -EAGAIN;
+
+	if (policy.mode != PROV_OVERFLOW_DROP
+	    && policy.mode != PROV_OVERFLOW_THROTTLE)
+		return -EINVAL;
+
+	// Every hook that can sleep may wait this long.
+	if (policy.wait_ms > PROV_OVERFLOW_MAX_WAIT_MS)
+		return -EINVAL;
+
+	WRITE_ONCE(prov_overflow.wait_ms, policy.wait_ms);
+	WRITE_ONCE(prov_overflow.mode, policy.mode);
+	return count;
+}
+
+static ssize_t prov_read_overflow(struct file *filp, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	if (count < sizeof(struct prov_overflow_policy))
+		return -ENOMEM;
+
+	if (copy_to_user(buf, &prov_overflow,
+			 sizeof(struct prov_overflow_policy)))
+		return -EAGAIN;
+	return sizeof(struct prov_overflow_policy);
+}
+declare_file_operations(prov_overflow_ops,
+			prov_write_overflow,
+			prov_read_overflow);
+
+static ssize_t prov_write_aggregate(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct prov_aggregate_policy policy;
+	int rc;
+
+	if (!capable(CAP_AUDIT_CONTROL))
+		return -EPERM;
+
+	if (count < sizeof(struct prov_aggregate_policy))
+		return -ENOMEM;
+
+	if (copy_from_user(&policy, buf, sizeof(struct prov_aggregate_policy)))
+		return -EAGAIN;
+
+	rc = prov_aggregate_set_window(policy.window_ms);
+	if (rc)
+		return rc;
+	return count;
+}
+
+static ssize_t prov_read_aggregate(struct file *filp, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct prov_aggregate_policy policy;
+
+	if (count < sizeof(struct prov_aggregate_policy))
+		return -ENOMEM;
+
+	policy.window_ms = READ_ONCE(prov_policy.aggregate_window);
+	if (copy_to_user(buf, &policy, sizeof(struct prov_aggregate_policy)))
+		return -EAGAIN;
+	return sizeof(struct prov_aggregate_policy);
+}
+declare_file_operations(prov_aggregate_ops,
+			prov_write_aggregate,
+			prov_read_aggregate);
+
+static ssize_t prov_read_target_cache(struct file *filp, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct prov_target_cache_info info;
+	int cpu;
+
+	if (count < sizeof(struct prov_target_cache_info))
+		return -ENOMEM;
+
+	memset(&info, 0, sizeof(struct prov_target_cache_info));
+	for_each_possible_cpu(cpu) {
+		info.hits += per_cpu(prov_target_stats, cpu).hits;
+		info.misses += per_cpu(prov_target_stats, cpu).misses;
+	}
+	info.generation = atomic_read(&prov_policy_generation);
+	if (copy_to_user(buf, &info, sizeof(struct prov_target_cache_info)))
+		return -EAGAIN;
+	return sizeof(struct prov_target_cache_info);
+}
+declare_file_operations(prov_target_cache_ops, no_write, prov_read_target_cache);
+
+static ssize_t prov_read_observe(struct file *filp, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct prov_observe_info info;
+
+	if (count < sizeof(struct prov_observe_info))
+		return -ENOMEM;
+
+	memset(&info, 0, sizeof(struct prov_observe_info));
+	info.dropped = provenance_observe_dropped();
+	if (copy_to_user(buf, &info, sizeof(struct prov_observe_info)))
+		return -EAGAIN;
+	return sizeof(struct prov_observe_info);
+}
+declare_file_operations(prov_observe_ops, no_write, prov_read_observe);
+
 declare_write_flag_fcn(prov_write_compress_node,
 		       prov_policy.should_compress_node);
 declare_read_flag_fcn(prov_read_compress_node,
@@ -130,6 +272,12 @@ declare_file_operations(prov_compress_edge_ops,
 			prov_write_compress_edge,
 			prov_read_compress_edge);
 
+declare_write_flag_fcn(prov_write_pack_args, prov_policy.should_pack_args);
+declare_read_flag_fcn(prov_read_pack_args, prov_policy.should_pack_args);
+declare_file_operations(prov_pack_args_ops,
+			prov_write_pack_args,
+			prov_read_pack_args);
+
 declare_write_flag_fcn(prov_write_duplicate, prov_policy.should_duplicate);
 declare_read_flag_fcn(prov_read_duplicate, prov_policy.should_duplicate);
 declare_file_operations(prov_duplicate_ops,
@@ -343,6 +491,8 @@ static ssize_t prov_read_self(struct file *filp, char __user *buf,
 	if (count < sizeof(struct task_prov_struct))
 		return -ENOMEM;
 
+	// Sampled outside the node lock, the lock only covers the copy.
+	update_task_perf(current, cprov);
 	spin_lock(prov_lock(cprov));
 	if (copy_to_user(buf, prov_elt(cprov), sizeof(union prov_elt)))
 		count = -EAGAIN;
@@ -369,6 +519,7 @@ static inline ssize_t __write_filter(struct file *file, const char __user *buf,
 		(*filter) |= setting.filter & setting.mask;
 	else
 		(*filter) &=  ~(setting.filter & setting.mask);
+	prov_policy_changed();
 
 	return count;
 }
@@ -550,9 +701,10 @@ declare_file_operations(prov_process_ops,
 			prov_read_process);
 
 static ssize_t __write_ipv4_filter(struct file *file, const char __user *buf,
-				   size_t count, struct list_head *filters)
+				   size_t count, struct ipv4_trie *filters)
 {
 	struct ipv4_filters *f;
+	int rc;
 
 	if (!capable(CAP_AUDIT_CONTROL))
 		return -EPERM;
@@ -568,33 +720,40 @@ static ssize_t __write_ipv4_filter(struct file *file, const char __user *buf,
 	f->filter.ip = f->filter.ip & f->filter.mask;
 	// we are not trying to delete something
 	if ((f->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE)
-		prov_ipv4_add_or_update(filters, f);
+		rc = prov_ipv4_add_or_update(filters, f);
 	else
-		prov_ipv4_delete(filters, f);
+		rc = prov_ipv4_delete(filters, f);
+	if (rc)
+		return rc;
+	prov_policy_changed();
 	return sizeof(struct prov_ipv4_filter);
 }
 
 static ssize_t __read_ipv4_filter(struct file *filp, char __user *buf,
-				  size_t count, struct list_head *filters)
+				  size_t count, struct ipv4_trie *filters)
 {
-	struct list_head *listentry, *listtmp;
 	struct ipv4_filters *tmp;
-	size_t pos = 0;
+	ssize_t pos = 0;
 
 	if (count < sizeof(struct prov_ipv4_filter))
 		return -ENOMEM;
 
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
-		if (count < pos + sizeof(struct prov_ipv4_filter))
-			return -ENOMEM;
+	mutex_lock(&prov_filter_lock);
+	list_for_each_entry(tmp, &filters->filters, list) {
+		if (count < pos + sizeof(struct prov_ipv4_filter)) {
+			pos = -ENOMEM;
+			break;
+		}
 
 		if (copy_to_user(buf + pos, &(tmp->filter),
-				 sizeof(struct prov_ipv4_filter)))
-			return -EAGAIN;
+				 sizeof(struct prov_ipv4_filter))) {
+			pos = -EAGAIN;
+			break;
+		}
 
 		pos += sizeof(struct prov_ipv4_filter);
 	}
+	mutex_unlock(&prov_filter_lock);
 	return pos;
 }
 
@@ -686,7 +845,8 @@ declare_file_operations(prov_secctx_ops, no_write, prov_read_secctx);
 		}										  \
 		if ((s->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE)			  \
 		add_function(s); else								  \
-		delete_function(s); return sizeof(struct filters);				  \
+		delete_function(s);								  \
+		prov_policy_changed(); return sizeof(struct filters);				  \
 	}
 
 #define declare_generic_filter_read(function_name, filters, info)			    \
@@ -695,19 +855,20 @@ declare_file_operations(prov_secctx_ops, no_write, prov_read_secctx);
 				     size_t count,					    \
 				     loff_t *ppos)					    \
 	{										    \
-		struct list_head *listentry, *listtmp;					    \
 		struct filters *tmp;							    \
-		size_t pos = 0;								    \
+		ssize_t pos = 0;							    \
+		int bkt;								    \
 		if (count < sizeof(struct info)) {					    \
 			return -ENOMEM; }						    \
-		list_for_each_safe(listentry, listtmp, &filters) {			    \
-			tmp = list_entry(listentry, struct filters, list);		    \
+		mutex_lock(&prov_filter_lock);						    \
+		hash_for_each(filters, bkt, tmp, list) {				    \
 			if (count < pos + sizeof(struct info)) {			    \
-				return -ENOMEM; }					    \
+				pos = -ENOMEM; break; }					    \
 			if (copy_to_user(buf + pos, &(tmp->filter), sizeof(struct info))) { \
-				return -EAGAIN; }					    \
+				pos = -EAGAIN; break; }					    \
 			pos += sizeof(struct info);					    \
 		}									    \
+		mutex_unlock(&prov_filter_lock);					    \
 		return pos;								    \
 	}
 
@@ -737,6 +898,7 @@ static ssize_t prov_write_secctx_filter(struct file *file,
 		prov_secctx_add_or_update(s);
 	else
 		prov_secctx_delete(s);
+	prov_policy_changed();
 	return sizeof(struct secinfo);
 }
 
@@ -768,6 +930,7 @@ static ssize_t prov_write_ns_filter(struct file *file, const char __user *buf,
 				    size_t count, loff_t *ppos)
 {
 	struct ns_filters *s;
+	int rc;
 
 	if (count < sizeof(struct nsinfo))
 		return -ENOMEM;
@@ -782,31 +945,38 @@ static ssize_t prov_write_ns_filter(struct file *file, const char __user *buf,
 	}
 
 	if ((s->filter.op & PROV_SET_DELETE) != PROV_SET_DELETE)
-		prov_ns_add_or_update(s);
+		rc = prov_ns_add_or_update(s);
 	else
-		prov_ns_delete(s);
+		rc = prov_ns_delete(s);
+	if (rc)
+		return rc;
+	prov_policy_changed();
 	return sizeof(struct nsinfo);
 }
 
 static ssize_t prov_read_ns_filter(struct file *filp, char __user *buf,
 				   size_t count, loff_t *ppos)
 {
-	struct list_head *listentry, *listtmp;
 	struct ns_filters *tmp;
-	size_t pos = 0;
+	ssize_t pos = 0;
 
 	if (count < sizeof(struct nsinfo))
 		return -ENOMEM;
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
-		if (count < pos + sizeof(struct nsinfo))
-			return -ENOMEM;
+	mutex_lock(&prov_filter_lock);
+	list_for_each_entry(tmp, &ns_filters, list) {
+		if (count < pos + sizeof(struct nsinfo)) {
+			pos = -ENOMEM;
+			break;
+		}
 		if (copy_to_user(buf + pos, &(tmp->filter),
-				 sizeof(struct nsinfo)))
-			return -EAGAIN;
+				 sizeof(struct nsinfo))) {
+			pos = -EAGAIN;
+			break;
+		}
 		pos += sizeof(struct nsinfo);
 	}
+	mutex_unlock(&prov_filter_lock);
 	return pos;
 }
 declare_file_operations(prov_ns_filter_ops,
@@ -883,17 +1053,26 @@ static ssize_t prov_write_logp(struct file *file, const char __user *buf,
 }
 declare_file_operations(prov_logp_ops, prov_write_logp, no_read);
 
-#define hash_filters(filters, filters_type, tmp, tmp_type)						 \
-	do {												 \
-		list_for_each_safe(listentry, listtmp, &filters) {					 \
-			tmp = list_entry(listentry, struct filters_type, list);				 \
+#define hash_filter_list(filters, tmp, tmp_type)						 \
+	do {											 \
+		if (rc)										 \
+			break;									 \
+		list_for_each_entry(tmp, &filters, list) {					 \
+			rc = crypto_shash_update(hashdesc, (u8 *)&tmp->filter, sizeof(struct tmp_type)); \
+			if (rc)									 \
+				break;								 \
+		}										 \
+	} while (0)
+
+#define hash_filter_table(table, tmp, tmp_type)						 \
+	do {											 \
+		if (rc)										 \
+			break;									 \
+		hash_for_each(table, bkt, tmp, list) {						 \
 			rc = crypto_shash_update(hashdesc, (u8 *)&tmp->filter, sizeof(struct tmp_type)); \
-			if (rc) {									 \
-				pr_err("Provenance: error updating hash.");				 \
-				pos = -EAGAIN;								 \
-				goto out;								 \
-			}										 \
-		}											 \
+			if (rc)									 \
+				break;								 \
+		}										 \
 	} while (0)
 
 static ssize_t prov_read_policy_hash(struct file *filp, char __user *buf,
@@ -905,12 +1084,12 @@ static ssize_t prov_read_policy_hash(struct file *filp, char __user *buf,
 	struct crypto_shash *policy_shash_tfm;
 	struct shash_desc *hashdesc = NULL;
 	uint8_t *buff = NULL;
-	struct list_head *listentry, *listtmp;
 	struct ipv4_filters *ipv4_tmp;
 	struct ns_filters *ns_tmp;
 	struct secctx_filters *secctx_tmp;
 	struct user_filters *user_tmp;
 	struct group_filters *group_tmp;
+	int bkt;
 
 	policy_shash_tfm = crypto_alloc_shash(PROVENANCE_HASH, 0, 0);
 	if (IS_ERR(policy_shash_tfm))
@@ -961,18 +1140,25 @@ static ssize_t prov_read_policy_hash(struct file *filp, char __user *buf,
 		pos = -EAGAIN;
 		goto out;
 	}
+	mutex_lock(&prov_filter_lock);
 	/* ingress network policy */
-	hash_filters(ingress_ipv4filters, ipv4_filters, ipv4_tmp, prov_ipv4_filter);
+	hash_filter_list(ingress_ipv4filters.filters, ipv4_tmp, prov_ipv4_filter);
 	/* egress network policy */
-	hash_filters(egress_ipv4filters, ipv4_filters, ipv4_tmp, prov_ipv4_filter);
+	hash_filter_list(egress_ipv4filters.filters, ipv4_tmp, prov_ipv4_filter);
 	/* namespace policy */
-	hash_filters(ns_filters, ns_filters, ns_tmp, ns_filters);
+	hash_filter_list(ns_filters, ns_tmp, nsinfo);
 	/* secctx policy */
-	hash_filters(secctx_filters, secctx_filters, secctx_tmp, secinfo);
+	hash_filter_table(secctx_filters, secctx_tmp, secinfo);
 	/* userid policy */
-	hash_filters(user_filters, user_filters, user_tmp, userinfo);
+	hash_filter_table(user_filters, user_tmp, userinfo);
 	/* groupid policy */
-	hash_filters(group_filters, group_filters, group_tmp, groupinfo);
+	hash_filter_table(group_filters, group_tmp, groupinfo);
+	mutex_unlock(&prov_filter_lock);
+	if (rc) {
+		pr_err("Provenance: error updating hash.");
+		pos = -EAGAIN;
+		goto out;
+	}
 
 	rc = crypto_shash_final(hashdesc, buff);
 	if (rc) {
@@ -1055,20 +1241,47 @@ static ssize_t prov_write_channel(struct file *file, const char __user *buf,
 				  size_t count, loff_t *ppos)
 {
 	char *buffer;
+	char *name;
 	int rtn = 0;
 
 	if (count <= 0 || count > PATH_MAX)
 		return -ENOMEM;
 
-	buffer = memdup_user(buf, count);
+	buffer = memdup_user_nul(buf, count);
 	if (IS_ERR(buffer))
 		return PTR_ERR(buffer);
 
-	rtn = prov_create_channel(buffer, count);
+	name = strim(buffer);
+	rtn = prov_create_channel(name, strlen(name));
 	kfree(buffer);
 	return rtn;
 }
-declare_file_operations(prov_channel_ops, prov_write_channel, no_read);
+
+#define MAX_CHANNEL    64
+
+static ssize_t prov_read_channel(struct file *filp, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct prov_channel_info *info;
+	ssize_t rc;
+
+	if (count < sizeof(struct prov_channel_info))
+		return -ENOMEM;
+
+	info = kcalloc(MAX_CHANNEL, sizeof(struct prov_channel_info),
+		       GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+
+	rc = prov_channel_info(info, min_t(size_t, MAX_CHANNEL,
+					   count / sizeof(struct prov_channel_info)));
+	rc *= sizeof(struct prov_channel_info);
+	if (copy_to_user(buf, info, rc))
+		rc = -EAGAIN;
+	kfree(info);
+	return rc;
+}
+declare_file_operations(prov_channel_ops, prov_write_channel, prov_read_channel);
 
 static ssize_t prov_write_epoch(struct file *file, const char __user *buf,
 				size_t count, loff_t *ppos)
@@ -1079,6 +1292,28 @@ static ssize_t prov_write_epoch(struct file *file, const char __user *buf,
 }
 declare_file_operations(prov_epoch_ops, prov_write_epoch, no_read);
 
+static ssize_t prov_read_ring(struct file *filp, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct prov_ring_info *info;
+	size_t nr = num_possible_cpus();
+	ssize_t rc;
+
+	if (count < nr * sizeof(struct prov_ring_info))
+		return -ENOMEM;
+
+	info = kcalloc(nr, sizeof(struct prov_ring_info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+
+	rc = prov_ring_info(info, nr) * sizeof(struct prov_ring_info);
+	if (copy_to_user(buf, info, rc))
+		rc = -EAGAIN;
+	kfree(info);
+	return rc;
+}
+declare_file_operations(prov_ring_ops, no_write, prov_read_ring);
+
 #define prov_create_file(name, perm, fun_ptr)					      \
 	do {									      \
 		dentry = securityfs_create_file(name, perm, prov_dir, NULL, fun_ptr); \
@@ -1094,8 +1329,14 @@ static __init int init_prov_fs(void)
 	prov_create_file("enable", 0644, &prov_enable_ops);
 	prov_create_file("all", 0644, &prov_all_ops);
 	prov_create_file("written", 0444, &prov_written_ops);
+	prov_create_file("dropped", 0444, &prov_dropped_ops);
+	prov_create_file("overflow", 0644, &prov_overflow_ops);
 	prov_create_file("compress_node", 0644, &prov_compress_node_ops);
 	prov_create_file("compress_edge", 0644, &prov_compress_edge_ops);
+	prov_create_file("pack_args", 0644, &prov_pack_args_ops);
+	prov_create_file("aggregate", 0644, &prov_aggregate_ops);
+	prov_create_file("target_cache", 0444, &prov_target_cache_ops);
+	prov_create_file("observe", 0444, &prov_observe_ops);
 	prov_create_file("node", 0666, &prov_node_ops);
 	prov_create_file("relation", 0666, &prov_relation_ops);
 	prov_create_file("self", 0666, &prov_self_ops);
@@ -1134,6 +1375,7 @@ static __init int init_prov_fs(void)
 	prov_create_file("channel", 0644, &prov_channel_ops);
 	prov_create_file("duplicate", 0644, &prov_duplicate_ops);
 	prov_create_file("epoch", 0644, &prov_epoch_ops);
+	prov_create_file("ring", 0444, &prov_ring_ops);
 	pr_info("Provenance: fs ready.\n");
 	return 0;
 }
@@ -23,6 +23,7 @@
 #include <linux/file.h>
 #include <linux/ptrace.h>
 #include <linux/workqueue.h>
+#include <linux/vmalloc.h>
 
 #include "provenance.h"
 #include "provenance_record.h"
@@ -109,6 +110,9 @@ static int provenance_task_alloc(struct task_struct *task,
 	struct provenance *cprov;
 
 	init_provenance_struct(ACT_TASK, ntprov);
+	// New mounts, see invalidate_exe_names.
+	if (clone_flags & CLONE_NEWNS)
+		invalidate_exe_names();
 	if (t != NULL) {
 		cred = (__force struct cred *)t->real_cred;
 		tprov = provenance_task(t);
@@ -124,6 +128,23 @@ static int provenance_task_alloc(struct task_struct *task,
 	return 0;
 }
 
+/*!
+ * @brief Sample the performance counters of a task node about to be written.
+ *
+ * Only the node of the current task can be sampled; other task nodes are
+ * written with the counters sampled when they were last written by their
+ * own task.
+ * @param node The ACT_TASK node, locked by the caller.
+ *
+ */
+void prov_sample_task(prov_entry_t *node)
+{
+	struct provenance *tprov = provenance_task(current);
+
+	if (node == prov_entry(tprov))
+		update_task_perf(current, tprov);
+}
+
 /*!
  * @brief Record provenance when task_free hook is triggered.
  *
@@ -138,6 +159,7 @@ static void provenance_task_free(struct task_struct *task)
 
 	if (tprov)
 		record_terminate(RL_TERMINATE_TASK, tprov);
+	kfree(*provenance_task_shmap(task));
 }
 
 /*!
@@ -464,6 +486,7 @@ static void provenance_inode_free_security(struct inode *inode)
 
 	if (iprov)
 		record_terminate(RL_FREED, iprov);
+	invalidate_exe_name(inode);
 }
 
 /*!
@@ -655,6 +678,7 @@ static int provenance_inode_unlink(struct inode *dir, struct dentry *dentry)
 	rc = generates(RL_UNLINK, cprov, tprov, iprov, NULL, 0);
 	spin_unlock(prov_lock(iprov));
 	spin_unlock_irqrestore(prov_lock(cprov), irqflags);
+	invalidate_exe_name(d_backing_inode(dentry));
 	return rc;
 }
 
@@ -724,6 +748,11 @@ static int provenance_inode_rename(struct inode *old_dir,
 	clear_name_recorded(prov_elt(iprov));
 	spin_unlock(prov_lock(iprov));
 	spin_unlock_irqrestore(prov_lock(cprov), irqflags);
+	// Paths below a renamed directory change too.
+	if (d_is_dir(old_dentry))
+		invalidate_exe_names();
+	invalidate_exe_name(d_backing_inode(old_dentry));
+	invalidate_exe_name(d_backing_inode(new_dentry));
 	record_inode_name_from_dentry(new_dentry, iprov, true);
 	return rc;
 }
@@ -2680,6 +2709,8 @@ static int provenance_sb_alloc_security(struct super_block *sb)
  */
 static void provenance_sb_free_security(struct super_block *sb)
 {
+	// Its root dentries are released, see invalidate_exe_names.
+	invalidate_exe_names();
 	if (sb->s_provenance)
 		free_provenance(sb->s_provenance);
 	sb->s_provenance = NULL;
@@ -2714,13 +2745,83 @@ static int provenance_sb_kern_mount(struct super_block *sb)
 	return 0;
 }
 
+/*!
+ * @brief Drop cached executable paths when sb_mount hook is triggered.
+ *
+ * A new mount changes the paths below its mountpoint and may reuse the
+ * address of a released mount (see invalidate_exe_names).
+ * @return always return 0.
+ *
+ */
+static int provenance_sb_mount(const char *dev_name, const struct path *path,
+			       const char *type, unsigned long flags,
+			       void *data)
+{
+	invalidate_exe_names();
+	return 0;
+}
+
+/*!
+ * @brief Drop cached executable paths when sb_umount hook is triggered.
+ *
+ * @return always return 0.
+ *
+ */
+static int provenance_sb_umount(struct vfsmount *mnt, int flags)
+{
+	invalidate_exe_names();
+	return 0;
+}
+
+/*!
+ * @brief Drop cached executable paths when sb_pivotroot hook is triggered.
+ *
+ * The root of the tasks of the mount namespace changes.
+ * @return always return 0.
+ *
+ */
+static int provenance_sb_pivotroot(const struct path *old_path,
+				   const struct path *new_path)
+{
+	invalidate_exe_names();
+	return 0;
+}
+
+/*!
+ * @brief Drop cached executable paths when move_mount hook is triggered.
+ *
+ * @return always return 0.
+ *
+ */
+static int provenance_move_mount(const struct path *from_path,
+				 const struct path *to_path)
+{
+	invalidate_exe_names();
+	return 0;
+}
+
+#ifdef CONFIG_SECURITY_PATH
+/*!
+ * @brief Drop cached executable paths when path_chroot hook is triggered.
+ *
+ * @return always return 0.
+ *
+ */
+static int provenance_path_chroot(const struct path *path)
+{
+	invalidate_exe_names();
+	return 0;
+}
+#endif
+
 struct lsm_blob_sizes provenance_blob_sizes __lsm_ro_after_init = {
-	.lbs_cred = sizeof(struct provenance),
+	.lbs_cred = sizeof(struct provenance) + sizeof(struct prov_cred_state),
 	.lbs_file = sizeof(struct provenance),
-	.lbs_inode = sizeof(struct provenance),
+	.lbs_inode = sizeof(struct provenance)
+		     + sizeof(struct prov_exe_name *),
 	.lbs_ipc = sizeof(struct provenance),
 	.lbs_msg_msg = sizeof(struct provenance),
-	.lbs_task = sizeof(struct provenance),
+	.lbs_task = sizeof(struct provenance) + sizeof(struct prov_shmap *),
 };
 
 /*!
@@ -2823,29 +2924,35 @@ static struct security_hook_list provenance_hooks[] __lsm_ro_after_init = {
 	/* file system related hooks */
 	LSM_HOOK_INIT(sb_alloc_security,        provenance_sb_alloc_security),
 	LSM_HOOK_INIT(sb_free_security,         provenance_sb_free_security),
-	LSM_HOOK_INIT(sb_kern_mount,            provenance_sb_kern_mount)
+	LSM_HOOK_INIT(sb_kern_mount,            provenance_sb_kern_mount),
+	LSM_HOOK_INIT(sb_mount,                 provenance_sb_mount),
+	LSM_HOOK_INIT(sb_umount,                provenance_sb_umount),
+	LSM_HOOK_INIT(sb_pivotroot,             provenance_sb_pivotroot),
+	LSM_HOOK_INIT(move_mount,               provenance_move_mount),
+#ifdef CONFIG_SECURITY_PATH
+	LSM_HOOK_INIT(path_chroot,              provenance_path_chroot),
+#endif
 };
 
 struct kmem_cache *provenance_cache __ro_after_init;
 struct kmem_cache *long_provenance_cache __ro_after_init;
-
-struct kmem_cache *boot_buffer_cache __ro_after_init;
-spinlock_t lock_buffer;
-LIST_HEAD(buffer_list);
-
-struct kmem_cache *long_boot_buffer_cache __ro_after_init;
-spinlock_t lock_long_buffer;
-LIST_HEAD(long_buffer_list);
-
-LIST_HEAD(ingress_ipv4filters);
-LIST_HEAD(egress_ipv4filters);
-LIST_HEAD(secctx_filters);
-LIST_HEAD(user_filters);
-LIST_HEAD(group_filters);
+union long_prov_elt *prov_scratch __ro_after_init;
+DEFINE_PER_CPU(unsigned long, prov_scratch_used);
+
+DEFINE_IPV4_TRIE(ingress_ipv4filters);
+DEFINE_IPV4_TRIE(egress_ipv4filters);
+DEFINE_HASHTABLE(secctx_filters, PROV_FILTER_HASH_BITS);
+DEFINE_HASHTABLE(user_filters, PROV_FILTER_HASH_BITS);
+DEFINE_HASHTABLE(group_filters, PROV_FILTER_HASH_BITS);
+DEFINE_MUTEX(prov_filter_lock);
 LIST_HEAD(ns_filters);
+struct prov_ns_index __rcu *prov_ns_index;
 LIST_HEAD(provenance_query_hooks);
 
 struct capture_policy prov_policy;
+atomic_t prov_policy_generation = ATOMIC_INIT(1);
+atomic_t prov_exe_name_generation;
+DEFINE_PER_CPU(struct prov_target_stats, prov_target_stats);
 
 uint32_t prov_machine_id;
 uint32_t prov_boot_id;
@@ -2859,6 +2966,7 @@ static __init void init_prov_policy(void)
 	prov_policy.should_duplicate = false;
 	prov_policy.should_compress_node = true;
 	prov_policy.should_compress_edge = true;
+	prov_policy.should_pack_args = false;
 #ifdef CONFIG_SECURITY_PROVENANCE_BOOT
 	prov_policy.prov_all = true;
 #else
@@ -2867,22 +2975,6 @@ static __init void init_prov_policy(void)
 	pr_info("Provenance: policy initialization finished.");
 }
 
-static __init void init_boot_cache(void)
-{
-	pr_info("Provenance: boot cache initialization started...");
-	boot_buffer_cache = kmem_cache_create("boot_buffer_cache",
-					      sizeof(struct boot_buffer),
-					      0, SLAB_PANIC, NULL);
-	if (unlikely(!boot_buffer_cache))
-		panic("Provenance: could not allocate boot_buffer_cache.");
-	long_boot_buffer_cache = kmem_cache_create("long_boot_buffer_cache",
-						   sizeof(struct long_boot_buffer),
-						   0, SLAB_PANIC, NULL);
-	if (unlikely(!long_boot_buffer_cache))
-		panic("Provenance: could not allocate long_boot_buffer_cache.");
-	pr_info("Provenance: boot cache initialization finished.");
-}
-
 static __init void init_prov_cache(void)
 {
 	pr_info("Provenance: cache initialization started...");
@@ -2896,6 +2988,10 @@ static __init void init_prov_cache(void)
 						  0, SLAB_PANIC, NULL);
 	if (unlikely(!long_provenance_cache))
 		panic("Provenance: could not allocate long_provenance_cache.");
+	prov_scratch = vzalloc(array3_size(nr_cpu_ids, PROV_SCRATCH_NR,
+					   sizeof(union long_prov_elt)));
+	if (unlikely(!prov_scratch))
+		pr_err("Provenance: could not allocate scratch elements.");
 	pr_info("Provenance: cache initialization finished.");
 }
 
@@ -2909,8 +3005,8 @@ static __init void init_prov_cache(void)
  * 4. Set up kernel memory cache for regular provenance entries (NULL on
  * failure).
  * 5. Set up kernel memory cache for long provenance entries (NULL on failure).
- * 6. Set up boot buffer for regualr provenance entries (NULL on failure).
- * 7. Set up boot buffer for long provenance entries (NULL on failure).
+ * 6. Set up per-CPU boot buffers for regular provenance entries.
+ * 7. Set up per-CPU boot buffers for long provenance entries.
  * (Note that we set up boot buffer because relayfs is not ready at this point.)
  * 8. Initialize a workqueue (NULL on failure).
  * 9. Initialize security for provenance task ("task_init_provenance" function).
@@ -2930,9 +3026,7 @@ static __init int provenance_init(void)
 	epoch = 1;
 	prov_written = false;
 	init_prov_cache();
-	init_boot_cache();
-	spin_lock_init(&lock_buffer);
-	spin_lock_init(&lock_long_buffer);
+	prov_boot_buffer_init();
 	relay_ready = false;
 #ifdef CONFIG_SECURITY_PROVENANCE_BOOT
 	pr_info("Provenance: boot cature is on.");
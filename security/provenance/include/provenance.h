@@ -17,6 +17,7 @@
 
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/percpu.h>
 #include <linux/bug.h>
 #include <linux/socket.h>
 #include <linux/lsm_hooks.h>
@@ -44,10 +45,53 @@ extern uint32_t prov_boot_id;
 extern uint32_t epoch;
 extern bool prov_written;
 
+/* Number of identifiers a CPU takes from a global counter at once. */
+#define PROV_ID_BATCH 256
+
+struct prov_id_block {
+	uint64_t next;
+	uint64_t end;
+};
+
+DECLARE_PER_CPU(struct prov_id_block, prov_relation_ids);
+DECLARE_PER_CPU(struct prov_id_block, prov_node_ids);
+
+/*!
+ * @brief Allocate an identifier from the block of the current CPU.
+ *
+ * Each CPU takes PROV_ID_BATCH identifiers at a time from the global
+ * counter, so that the counter cache line is only touched once per block.
+ * Identifiers are unique (per boot and machine) and never 0, increasing for
+ * a given CPU, but not ordered across CPUs (see "Ordering" in provenance.h
+ * for the order of entries).
+ * @param blocks Per-CPU blocks.
+ * @param counter Global counter the blocks are taken from.
+ * @return The identifier.
+ *
+ */
+static __always_inline uint64_t __prov_next_id(struct prov_id_block __percpu *blocks,
+					       atomic64_t *counter)
+{
+	struct prov_id_block *block;
+	unsigned long irqflags;
+	uint64_t id;
+
+	local_irq_save(irqflags);
+	block = this_cpu_ptr(blocks);
+	if (unlikely(block->next == block->end)) {
+		block->end = (uint64_t)atomic64_add_return(PROV_ID_BATCH,
+							   counter) + 1;
+		block->next = block->end - PROV_ID_BATCH;
+	}
+	id = block->next++;
+	local_irq_restore(irqflags);
+	return id;
+}
+
 #define prov_next_relation_id()	\
-	((uint64_t)atomic64_inc_return(&prov_relation_id))
+	__prov_next_id(&prov_relation_ids, &prov_relation_id)
 #define prov_next_node_id() \
-	((uint64_t)atomic64_inc_return(&prov_node_id))
+	__prov_next_id(&prov_node_ids, &prov_node_id)
 
 enum {
 	PROVENANCE_LOCK_PROC,
@@ -62,17 +106,122 @@ enum {
 struct provenance {
 	union prov_elt msg;
 	spinlock_t lock;
+	// Cached result of target_op, valid for this policy generation.
+	uint32_t target_generation;
+	uint8_t target_op;
 };
 
 #define prov_elt(provenance)            (&(provenance->msg))
 #define prov_lock(provenance)           (&(provenance->lock))
 #define prov_entry(provenance)          ((prov_entry_t *)prov_elt(provenance))
 
+/*
+ * Generation of the capture policy, bumped by every filter write (see
+ * prov_policy_changed). Starts at 1, a node generation of 0 is never valid.
+ */
+extern atomic_t prov_policy_generation;
+
+struct prov_target_stats {
+	uint64_t hits;
+	uint64_t misses;
+};
+DECLARE_PER_CPU(struct prov_target_stats, prov_target_stats);
+
+/*!
+ * @brief Invalidate cached policy decisions after the policy changed.
+ *
+ * Must be called after the change is made.
+ */
+static inline void prov_policy_changed(void)
+{
+	smp_mb__before_atomic();
+	atomic_inc(&prov_policy_generation);
+}
+
+/*!
+ * @brief Invalidate the cached policy decision of a node after one of the
+ * attributes target_op depends on changed.
+ */
+static __always_inline void invalidate_target(struct provenance *prov)
+{
+	prov->target_generation = 0;
+}
+
+/* Update an attribute target_op depends on, invalidating the cache if needed */
+#define update_target_attr(prov, attr, val) do {	\
+		typeof(attr) __val = (val);		\
+		if ((attr) != __val) {			\
+			(attr) = __val;			\
+			invalidate_target(prov);	\
+		}					\
+} while (0)
+
+/*!
+ * @brief Mark a node as tracked/propagated/opaque according to the capture
+ * policy (see target_op).
+ *
+ * The op value is only computed again when the policy generation changed
+ * since it was cached, or when the node's attributes changed (see
+ * invalidate_target). Called with the node lock held.
+ * @param prov The provenance node in question.
+ *
+ */
+static __always_inline void apply_target(struct provenance *prov)
+{
+	uint32_t generation = atomic_read(&prov_policy_generation);
+
+	if (likely(prov->target_generation == generation)) {
+		this_cpu_inc(prov_target_stats.hits);
+	} else {
+		// The generation is read before the filters, pairs with
+		// prov_policy_changed.
+		smp_rmb();
+		prov->target_op = target_op(prov_elt(prov));
+		prov->target_generation = generation;
+		this_cpu_inc(prov_target_stats.misses);
+	}
+	apply_op(prov_elt(prov), prov->target_op);
+}
+
 #define ASSIGN_NODE_ID    0
 
 extern struct kmem_cache *provenance_cache;
 extern struct kmem_cache *long_provenance_cache;
 
+/* Preallocated transient long nodes per CPU, see alloc_long_provenance */
+#define PROV_SCRATCH_NR 4
+// PROV_SCRATCH_NR elements per possible CPU.
+extern union long_prov_elt *prov_scratch;
+// One bit per element of the CPU, set while the element is in use.
+DECLARE_PER_CPU(unsigned long, prov_scratch_used);
+
+static __always_inline union long_prov_elt *prov_scratch_get(void)
+{
+	int cpu = raw_smp_processor_id();
+	unsigned long *used = per_cpu_ptr(&prov_scratch_used, cpu);
+	int i;
+
+	if (unlikely(!prov_scratch))
+		return NULL;
+	for (i = 0; i < PROV_SCRATCH_NR; i++) {
+		if (!test_and_set_bit_lock(i, used))
+			return &prov_scratch[cpu * PROV_SCRATCH_NR + i];
+	}
+	return NULL;
+}
+
+static __always_inline bool prov_scratch_put(union long_prov_elt *prov)
+{
+	unsigned long i = prov - prov_scratch;
+
+	if (!prov_scratch || prov < prov_scratch
+	    || i >= nr_cpu_ids * PROV_SCRATCH_NR)
+		return false;
+	clear_bit_unlock(i % PROV_SCRATCH_NR,
+			 per_cpu_ptr(&prov_scratch_used, i / PROV_SCRATCH_NR));
+	return true;
+}
+
 static __always_inline void init_provenance_struct(uint64_t ntype,
 						   struct provenance *prov)
 {
@@ -135,6 +284,10 @@ static inline void free_provenance(struct provenance *prov)
  * "zalloc".
  * Spin lock is not needed because at most one thread will access the structure
  * at a time, since it is a transient element.
+ * The element is taken from the preallocated elements of the CPU when one is
+ * free (an element is held by its user, who may sleep or migrate, until it is
+ * freed); memory is only allocated from the cache when they are all in use
+ * (e.g., by interrupted or preempted users).
  * @param ntype The type of the long provenance node.
  * @return The pointer to the long provenance node (long_prov_elt union
  * structure) or NULL if allocating memory from cache failed.
@@ -145,12 +298,15 @@ static __always_inline union long_prov_elt *alloc_long_provenance(
 	uint64_t ntype,
 	uint64_t id)
 {
-	union long_prov_elt *prov = kmem_cache_zalloc(long_provenance_cache,
-						      GFP_ATOMIC);
+	union long_prov_elt *prov = prov_scratch_get();
 
 	BUILD_BUG_ON(!prov_type_is_node(ntype));
 	BUILD_BUG_ON(!prov_type_is_long(ntype));
 
+	if (likely(prov))
+		memset(prov, 0, sizeof(union long_prov_elt));
+	else
+		prov = kmem_cache_zalloc(long_provenance_cache, GFP_ATOMIC);
 	if (!prov)
 		return NULL;
 	prov_type(prov) = ntype;
@@ -170,7 +326,8 @@ static __always_inline union long_prov_elt *alloc_long_provenance(
 static inline void free_long_provenance(union long_prov_elt *prov)
 {
 	call_provenance_free(prov);
-	kmem_cache_free(long_provenance_cache, prov);
+	if (!prov_scratch_put(prov))
+		kmem_cache_free(long_provenance_cache, prov);
 }
 
 #define set_recorded(node) \
@@ -244,11 +401,38 @@ static inline struct provenance *provenance_cred(const struct cred *cred)
 	return cred->security + provenance_blob_sizes.lbs_cred;
 }
 
+/*
+ * What the process information of a cred was last read from, see
+ * get_cred_provenance. Zeroed when the cred is allocated, so that a new cred
+ * is always read.
+ */
+struct prov_cred_state {
+	// Node identifier of the real cred the secid was read from. Unlike the
+	// address of the cred, it is never reused.
+	uint64_t real_cred_id;
+};
+
+/* State of the cred provenance, stored after it */
+static inline struct prov_cred_state *provenance_cred_state(
+	const struct cred *cred)
+{
+	return (struct prov_cred_state *)(provenance_cred(cred) + 1);
+}
+
 static inline struct provenance *provenance_task(const struct task_struct *task)
 {
 	return task->security + provenance_blob_sizes.lbs_task;
 }
 
+struct prov_shmap;
+
+/* Cached shared file mappings of a task, stored after its provenance */
+static inline struct prov_shmap **provenance_task_shmap(
+	const struct task_struct *task)
+{
+	return (struct prov_shmap **)(provenance_task(task) + 1);
+}
+
 static inline struct provenance *provenance_cred_from_task(
 	struct task_struct *task)
 {
@@ -273,6 +457,33 @@ static inline struct provenance *provenance_inode(
 	return inode->i_security + provenance_blob_sizes.lbs_inode;
 }
 
+/*
+ * Resolved path of an executable, cached on its inode (see record_exe_name).
+ * file_path resolves the path from the root of the current task, the root
+ * is kept (but not referenced) to only reuse the path from the same root.
+ * The root pointers are only compared and are never dereferenced: a freed
+ * root could be reused by a new mount, so the generation changes whenever
+ * roots or mounts change (see invalidate_exe_names).
+ */
+struct prov_exe_name {
+	struct rcu_head rcu;
+	struct dentry *root_dentry;
+	struct vfsmount *root_mnt;
+	// Value of prov_exe_name_generation when the path was resolved.
+	int generation;
+	char name[];
+};
+
+/* Cached executable path of an inode, stored after its provenance */
+static inline struct prov_exe_name __rcu **provenance_inode_exe_name(
+	const struct inode *inode)
+{
+	return (struct prov_exe_name __rcu **)(provenance_inode(inode) + 1);
+}
+
+/* Incremented when paths or roots may change, see invalidate_exe_names */
+extern atomic_t prov_exe_name_generation;
+
 static inline struct provenance *provenance_msg_msg(
 	const struct msg_msg *msg_msg)
 {
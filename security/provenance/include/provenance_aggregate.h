@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2020 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_AGGREGATE_H
+#define _PROVENANCE_AGGREGATE_H
+
+#include <uapi/linux/provenance.h>
+
+/* Number of buckets of the aggregation table (power of two) */
+#define PROV_AGG_BUCKETS 256
+/* Pending relations per bucket */
+#define PROV_AGG_SLOTS 4
+
+bool prov_aggregate_hit(uint64_t type, prov_entry_t *from, prov_entry_t *to);
+void prov_aggregate_insert(union prov_elt *relation);
+void prov_aggregate_flush(prov_entry_t *node);
+int prov_aggregate_set_window(uint32_t window_ms);
+
+#endif
@@ -15,6 +15,8 @@
 #ifndef _PROVENANCE_FILTER_H
 #define _PROVENANCE_FILTER_H
 
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 #include <uapi/linux/provenance.h>
 #include <uapi/linux/provenance_fs.h>
 
@@ -179,86 +181,97 @@ static __always_inline bool should_record_relation(const uint64_t type,
 	return true;
 }
 
+/* Number of buckets (log2) of the uid, gid and secctx filter tables */
+#define PROV_FILTER_HASH_BITS 10
+
 /*!
- * @brief Define an abstract list. See concrete example below.
+ * @brief Define an abstract hash table keyed by a 32 bits value.
+ * See concrete example below.
  */
-#define declare_filter_list(filter_name, type) \
-	struct filter_name {		       \
-		struct list_head list;	       \
-		struct type filter;	       \
-	};				       \
-	extern struct list_head filter_name;
+#define declare_filter_list(filter_name, type)			   \
+	struct filter_name {					   \
+		struct hlist_node list;				   \
+		struct rcu_head rcu;				   \
+		struct type filter;				   \
+	};							   \
+	extern struct hlist_head filter_name[1 << PROV_FILTER_HASH_BITS];
 
 /*!
  * @brief Define an abstract operation that returns op value of an item in a
- * list. See concrete example below.
+ * table. See concrete example below.
  */
-#define declare_filter_whichOP(function_name, type, variable)		\
-	static __always_inline uint8_t function_name(uint32_t variable)	\
-	{								\
-		struct list_head *listentry, *listtmp;			\
-		struct type *tmp;					\
-		list_for_each_safe(listentry, listtmp, &type) {		\
-			tmp = list_entry(listentry, struct type, list);	\
-			if (tmp->filter.variable == variable) {		\
-				return tmp->filter.op; }		\
-		}							\
-		return 0;						\
+#define declare_filter_whichOP(function_name, type, variable)		   \
+	static __always_inline uint8_t function_name(uint32_t variable)	   \
+	{								   \
+		struct type *tmp;					   \
+		uint8_t op = 0;						   \
+		rcu_read_lock();					   \
+		hash_for_each_possible_rcu(type, tmp, list, variable) {	   \
+			if (tmp->filter.variable == variable) {		   \
+				op = READ_ONCE(tmp->filter.op);		   \
+				break; }				   \
+		}							   \
+		rcu_read_unlock();					   \
+		return op;						   \
 	}
 
 /*!
- * @brief Define an abstract operation that deletes an item from a list.
- * See concrete example below.
+ * @brief Define an abstract operation that deletes an item from a table.
+ * The item given in argument is freed. See concrete example below.
  */
 #define declare_filter_delete(function_name, type, variable)		  \
 	static __always_inline uint8_t function_name(struct type *f)	  \
 	{								  \
-		struct list_head *listentry, *listtmp;			  \
 		struct type *tmp;					  \
-		list_for_each_safe(listentry, listtmp, &type) {		  \
-			tmp = list_entry(listentry, struct type, list);	  \
+		mutex_lock(&prov_filter_lock);				  \
+		hash_for_each_possible(type, tmp, list, f->filter.variable) { \
 			if (tmp->filter.variable == f->filter.variable) { \
-				list_del(listentry);			  \
-				kfree(tmp);				  \
-				return 0;				  \
+				hash_del_rcu(&tmp->list);		  \
+				kfree_rcu(tmp, rcu);			  \
+				break;					  \
 			}						  \
 		}							  \
+		mutex_unlock(&prov_filter_lock);			  \
+		kfree(f);						  \
 		return 0;						  \
 	}
 
 /*!
  * @brief Define an abstract operation that adds/updates the op value of an item
- * from a list. See concrete example below.
+ * from a table. The item given in argument is inserted or freed.
+ * See concrete example below.
  */
 #define declare_filter_add_or_update(function_name, type, variable)	  \
 	static __always_inline uint8_t function_name(struct type *f)	  \
 	{								  \
-		struct list_head *listentry, *listtmp;			  \
 		struct type *tmp;					  \
-		list_for_each_safe(listentry, listtmp, &type) {		  \
-			tmp = list_entry(listentry, struct type, list);	  \
+		mutex_lock(&prov_filter_lock);				  \
+		hash_for_each_possible(type, tmp, list, f->filter.variable) { \
 			if (tmp->filter.variable == f->filter.variable) { \
-				tmp->filter.op = f->filter.op;		  \
+				WRITE_ONCE(tmp->filter.op, f->filter.op); \
+				mutex_unlock(&prov_filter_lock);	  \
+				kfree(f);				  \
 				return 0;				  \
 			}						  \
 		}							  \
-		list_add_tail(&(f->list), &type);			  \
+		hash_add_rcu(type, &f->list, f->filter.variable);	  \
+		mutex_unlock(&prov_filter_lock);			  \
 		return 0;						  \
 	}
 /*
- * A list of secinfo structs (defined in /include/uapi/linux/provenance.h, same
+ * A table of secinfo structs (defined in /include/uapi/linux/provenance.h, same
  * as the following)
  */
 declare_filter_list(secctx_filters, secinfo);
 
 /*
- * Return op value of an item of a specific secid in the secctx_filters list if
+ * Return op value of an item of a specific secid in the secctx_filters table if
  * exists; return 0 otherwise
  */
 declare_filter_whichOP(prov_secctx_whichOP, secctx_filters, secid);
 
 /*
- * Delete the element in secctx_filters list with the same secid as the item
+ * Delete the element in secctx_filters table with the same secid as the item
  * given in the function argument
  */
 declare_filter_delete(prov_secctx_delete, secctx_filters, secid);
@@ -270,7 +283,7 @@ declare_filter_delete(prov_secctx_delete, secctx_filters, secid);
 declare_filter_add_or_update(prov_secctx_add_or_update, secctx_filters, secid);
 
 /*!
- * @brief Same set of operations as above but operate on "userinfo" list.
+ * @brief Same set of operations as above but operate on "userinfo" table.
  */
 declare_filter_list(user_filters, userinfo);
 declare_filter_whichOP(prov_uid_whichOP, user_filters, uid);
@@ -278,7 +291,7 @@ declare_filter_delete(prov_uid_delete, user_filters, uid);
 declare_filter_add_or_update(prov_uid_add_or_update, user_filters, uid);
 
 /*!
- * @brief Same set of operations as above but operate on "groupinfo" list.
+ * @brief Same set of operations as above but operate on "groupinfo" table.
  */
 declare_filter_list(group_filters, groupinfo);
 declare_filter_whichOP(prov_gid_whichOP, group_filters, gid);
@@ -286,8 +299,8 @@ declare_filter_delete(prov_gid_delete, group_filters, gid);
 declare_filter_add_or_update(prov_gid_add_or_update, group_filters, gid);
 
 /*!
- * @brief Based on "op" value of a provenance node, decide whether it should be
- * tracked/propagated/opaque.
+ * @brief Compute the "op" value of a provenance node, which decides whether it
+ * should be tracked/propagated/opaque.
  *
  * "op" value is contingent upon "op" values of:
  * 1. ns (i.e., namespace) elements: ipcns, mntns, pidns, netns, cgroupns,
@@ -295,10 +308,12 @@ declare_filter_add_or_update(prov_gid_add_or_update, group_filters, gid);
  * 2. secctx (i.e., security context) element if it has secctx, and
  * 3. uid element if it has uid, and
  * 4. gid element if it has gid.
+ * The result is cached in the node, see apply_target.
  * @param prov The provenance node in question.
+ * @return The op value.
  *
  */
-static __always_inline void apply_target(union prov_elt *prov)
+static __always_inline uint8_t target_op(union prov_elt *prov)
 {
 	uint8_t op = 0;
 
@@ -318,7 +333,11 @@ static __always_inline void apply_target(union prov_elt *prov)
 		op |= prov_uid_whichOP(node_uid(prov));
 		op |= prov_gid_whichOP(node_gid(prov));
 	}
+	return op;
+}
 
+static __always_inline void apply_op(union prov_elt *prov, uint8_t op)
+{
 	if (unlikely(op != 0)) {
 		if ((op & PROV_SET_TRACKED) != 0)
 			set_tracked(prov);
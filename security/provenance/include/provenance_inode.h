@@ -29,6 +29,37 @@
 #define is_inode_socket(inode)          S_ISSOCK(inode->i_mode)
 #define is_inode_file(inode)            S_ISREG(inode->i_mode)
 
+/*!
+ * @brief Drop the executable path cached on @inode (see record_exe_name).
+ *
+ * @param inode The inode being renamed, unlinked or freed.
+ *
+ */
+static inline void invalidate_exe_name(struct inode *inode)
+{
+	struct prov_exe_name *name;
+
+	if (unlikely(!inode || !inode->i_security))
+		return;
+	name = xchg((__force struct prov_exe_name **)
+		    provenance_inode_exe_name(inode), NULL);
+	if (name)
+		kfree_rcu(name, rcu);
+}
+
+/*!
+ * @brief Drop every cached executable path (see record_exe_name).
+ *
+ * Called when a directory is renamed, when a task changes its root and when
+ * mounts are created or released, as a cached root (which is not referenced)
+ * may then be freed and its address reused.
+ *
+ */
+static inline void invalidate_exe_names(void)
+{
+	atomic_inc(&prov_exe_name_generation);
+}
+
 /*!
  * @brief Update the type of the provenance inode node based on the mode of the
  * inode, and create a version relation between old and new provenance node.
@@ -76,11 +107,12 @@ static inline void update_inode_type(uint16_t mode, struct provenance *prov)
 	if (prov_elt(prov)->inode_info.mode != 0
 	    && prov_elt(prov)->inode_info.mode != mode
 	    && provenance_is_recorded(prov_elt(prov))) {
+		prov_aggregate_flush(prov_entry(prov));
 		__memcpy_ss(&old_prov, sizeof(union prov_elt),
 			    prov_elt(prov), sizeof(old_prov));
 		// We update the info of the new version and record it.
 		prov_elt(prov)->inode_info.mode = mode;
-		prov_type(prov_elt(prov)) = type;
+		update_target_attr(prov, prov_type(prov_elt(prov)), type);
 		node_identifier(prov_elt(prov)).version++;
 		clear_recorded(prov_elt(prov));
 
@@ -91,7 +123,7 @@ static inline void update_inode_type(uint16_t mode, struct provenance *prov)
 		clear_saved(prov_elt(prov));
 	}
 	prov_elt(prov)->inode_info.mode = mode;
-	prov_type(prov_elt(prov)) = type;
+	update_target_attr(prov, prov_type(prov_elt(prov)), type);
 	spin_unlock_irqrestore(prov_lock(prov), irqflags);
 }
 
@@ -219,12 +251,17 @@ static inline int record_inode_name(struct inode *inode,
 static inline void refresh_inode_provenance(struct inode *inode,
 					    struct provenance *prov)
 {
+	uint32_t secid;
+
 	if (provenance_is_opaque(prov_elt(prov)))
 		return;
+	security_inode_getsecid(inode, &secid);
 	prov_elt(prov)->inode_info.ino = inode->i_ino;
-	node_uid(prov_elt(prov)) = __kuid_val(inode->i_uid);
-	node_gid(prov_elt(prov)) = __kgid_val(inode->i_gid);
-	security_inode_getsecid(inode, &(prov_elt(prov)->inode_info.secid));
+	update_target_attr(prov, node_uid(prov_elt(prov)),
+			   __kuid_val(inode->i_uid));
+	update_target_attr(prov, node_gid(prov_elt(prov)),
+			   __kgid_val(inode->i_gid));
+	update_target_attr(prov, prov_elt(prov)->inode_info.secid, secid);
 	update_inode_type(inode->i_mode, prov);
 }
 
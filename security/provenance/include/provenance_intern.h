@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2020 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef _PROVENANCE_INTERN_H
+#define _PROVENANCE_INTERN_H
+
+#include <linux/types.h>
+#include <linux/jhash.h>
+
+/* Number of buckets of the path intern table (log2) */
+#define PROV_INTERN_HASH_BITS 12
+/* Maximum number of interned paths */
+#define PROV_INTERN_MAX 16384
+
+/*!
+ * @brief Second hash of a path, independent from djb2_hash.
+ *
+ * @param name The path.
+ * @param length The length of the path.
+ * @return The hash of the path.
+ *
+ */
+static inline uint32_t prov_intern_check(const char *name, size_t length)
+{
+	return jhash(name, length, 0);
+}
+
+int prov_intern_generation(void);
+void prov_intern_flush(void);
+bool prov_path_interned(uint64_t hash, uint32_t check);
+void prov_path_intern(uint64_t hash, uint32_t check, int gen);
+
+#endif
@@ -205,111 +205,286 @@ static __always_inline struct provenance *provenance_alloc_with_ipv4_skb(
 	return prov;
 }
 
+/* Maximum number of nodes on the path to a prefix (/0 to /32) */
+#define PROV_IPV4_DEPTH 33
+
 struct ipv4_filters {
+	// Every filter of the trie, see struct ipv4_trie.
 	struct list_head list;
+	// Filters of the same prefix, see struct ipv4_trie_node.
+	struct list_head node_list;
+	struct rcu_head rcu;
 	struct prov_ipv4_filter filter;
 };
 
-extern struct list_head ingress_ipv4filters;
-extern struct list_head egress_ipv4filters;
+struct ipv4_trie_node {
+	struct ipv4_trie_node __rcu *child[2];
+	// Filters of this prefix, with or without a port.
+	struct list_head filters;
+	struct rcu_head rcu;
+};
+
+/*
+ * Binary trie of IPv4 filters indexed by prefix, most significant bit first.
+ * The filters of a /n prefix hang off the node at depth n. Lookups walk the
+ * trie under RCU; updates and the filters list (used to read the policy back
+ * in insertion order) are protected by prov_filter_lock.
+ */
+struct ipv4_trie {
+	struct ipv4_trie_node __rcu *root;
+	struct list_head filters;
+};
+
+#define DEFINE_IPV4_TRIE(name) \
+	struct ipv4_trie name = { .filters = LIST_HEAD_INIT(name.filters) }
+
+extern struct ipv4_trie ingress_ipv4filters;
+extern struct ipv4_trie egress_ipv4filters;
 
 #define prov_ipv4_ingressOP(ip, port) \
 	prov_ipv4_whichOP(&ingress_ipv4filters, ip, port)
 #define prov_ipv4_egressOP(ip, port) \
 	prov_ipv4_whichOP(&egress_ipv4filters, ip, port)
 
+#define ipv4_bit(key, depth)    (((key) >> (31 - (depth))) & 1)
+
+/*!
+ * @brief Return the prefix length of a mask.
+ * @param mask The mask (network byte order).
+ * @return The prefix length or -EINVAL if the mask is not contiguous.
+ *
+ */
+static inline int prov_ipv4_prefix_len(uint32_t mask)
+{
+	uint32_t m = be32_to_cpu((__force __be32)mask);
+	int len = hweight32(m);
+
+	if (len && m != ~0U << (32 - len))
+		return -EINVAL;
+	return len;
+}
+
 /*!
  * @brief Returns op value of the filter of a specific IP and/or port.
  *
- * This function goes through a filter list,
- * and attempts to match the given @ip and @port.
- * If matched, the op value of the matched element will be returned.
- * @param filters The list to go through.
+ * This function walks the filter trie along @ip,
+ * and returns the op value of the most specific filter matching @ip and
+ * @port: the longest prefix wins and, for the same prefix, a filter on @port
+ * wins over a filter on any port.
+ * @param trie The trie to go through.
  * @param ip The IP to match.
  * @param port The port to match.
- * @return 0 if not found or the op value of the matched element in the list.
+ * @return 0 if not found or the op value of the matched element in the trie.
  *
  */
-static inline uint8_t prov_ipv4_whichOP(struct list_head *filters,
+static inline uint8_t prov_ipv4_whichOP(struct ipv4_trie *trie,
 					uint32_t ip,
 					uint32_t port)
 {
-	struct list_head *listentry, *listtmp;
+	uint32_t key = be32_to_cpu((__force __be32)ip);
+	struct ipv4_trie_node *node;
 	struct ipv4_filters *tmp;
+	uint8_t op = 0;
+	uint8_t any = 0;
+	bool found;
+	int depth;
+
+	rcu_read_lock();
+	node = rcu_dereference(trie->root);
+	for (depth = 0; node; depth++) {
+		found = false;
+		list_for_each_entry_rcu(tmp, &node->filters, node_list) {
+			if (tmp->filter.port == port) {
+				op = READ_ONCE(tmp->filter.op);
+				found = false;
+				break;
+			}
+			if (tmp->filter.port == 0) {
+				any = READ_ONCE(tmp->filter.op);
+				found = true;
+			}
+		}
+		if (found)
+			op = any;
+		if (depth == 32)
+			break;
+		node = rcu_dereference(node->child[ipv4_bit(key, depth)]);
+	}
+	rcu_read_unlock();
+	return op;
+}
 
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
-		// Match IP
-		if ((tmp->filter.mask & ip)
-		    == (tmp->filter.mask & tmp->filter.ip))
-			// Any port or a specific match
-			if (tmp->filter.port == 0 || tmp->filter.port == port)
-				return tmp->filter.op;
+/*!
+ * @brief Find the slots on the path to a prefix.
+ *
+ * Called with prov_filter_lock held.
+ * @param trie The trie.
+ * @param key The prefix (host byte order).
+ * @param len The prefix length.
+ * @param path The slots of the nodes on the path from the root.
+ * @return The number of nodes that exist on the path, len + 1 if the node of
+ * the prefix exists. Otherwise, the slot of the first missing node is
+ * path[returned value].
+ *
+ */
+static inline int ipv4_trie_path(struct ipv4_trie *trie,
+				 uint32_t key,
+				 int len,
+				 struct ipv4_trie_node __rcu **path[PROV_IPV4_DEPTH])
+{
+	struct ipv4_trie_node *node;
+	int depth;
+
+	path[0] = &trie->root;
+	for (depth = 0; depth <= len; depth++) {
+		node = rcu_dereference_protected(*path[depth],
+						 lockdep_is_held(&prov_filter_lock));
+		if (!node)
+			break;
+		if (depth < len)
+			path[depth + 1] = &node->child[ipv4_bit(key, depth)];
 	}
-	return 0;
+	return depth;
 }
 
 /*!
- * @brief Delete an element in the filter list that matches a specific filter.
+ * @brief Free the nodes at the end of a path that hold no filter and have no
+ * child.
  *
- * This function goes through a filter list,
+ * Called with prov_filter_lock held.
+ * @param path The slots of the nodes on the path (see ipv4_trie_path).
+ * @param nr The number of nodes on the path.
+ *
+ */
+static inline void ipv4_trie_prune(struct ipv4_trie_node __rcu **path[PROV_IPV4_DEPTH],
+				   int nr)
+{
+	struct ipv4_trie_node *node;
+
+	while (nr-- > 0) {
+		node = rcu_dereference_protected(*path[nr],
+						 lockdep_is_held(&prov_filter_lock));
+		if (!list_empty(&node->filters)
+		    || rcu_access_pointer(node->child[0])
+		    || rcu_access_pointer(node->child[1]))
+			return;
+		RCU_INIT_POINTER(*path[nr], NULL);
+		kfree_rcu(node, rcu);
+	}
+}
+
+static __always_inline struct ipv4_filters *ipv4_trie_find(struct ipv4_trie_node *node,
+							   struct ipv4_filters *f)
+{
+	struct ipv4_filters *tmp;
+
+	list_for_each_entry(tmp, &node->filters, node_list) {
+		if (tmp->filter.port == f->filter.port)
+			return tmp;
+	}
+	return NULL;
+}
+
+/*!
+ * @brief Delete an element in the filter trie that matches a specific filter.
+ *
+ * This function walks the filter trie to the prefix of the given filter,
  * and attempts to match the given filter.
- * If matched, the matched element will be removed from the list.
- * @param filters The list to go through.
+ * If matched, the matched element will be removed from the trie.
+ * The filter given in argument is freed.
+ * @param trie The trie to go through.
  * @param f The filter to match its mask, ip and port.
- * @return Always return 0.
+ * @return 0 or -EINVAL if the mask is not contiguous.
  *
  */
-static inline uint8_t prov_ipv4_delete(struct list_head *filters,
-				       struct ipv4_filters *f)
+static inline int prov_ipv4_delete(struct ipv4_trie *trie,
+				   struct ipv4_filters *f)
 {
-	struct list_head *listentry, *listtmp;
+	struct ipv4_trie_node __rcu **path[PROV_IPV4_DEPTH];
+	int len = prov_ipv4_prefix_len(f->filter.mask);
+	struct ipv4_trie_node *node;
 	struct ipv4_filters *tmp;
+	int nr;
 
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
-		if (tmp->filter.mask == f->filter.mask &&
-		    tmp->filter.ip == f->filter.ip &&
-		    tmp->filter.port == f->filter.port) {
-			list_del(listentry);
-			kfree(tmp);
-			return 0;       // Should only get one.
+	if (len < 0)
+		goto out;
+	mutex_lock(&prov_filter_lock);
+	nr = ipv4_trie_path(trie, be32_to_cpu((__force __be32)f->filter.ip),
+			    len, path);
+	if (nr == len + 1) {
+		node = rcu_dereference_protected(*path[len],
+						 lockdep_is_held(&prov_filter_lock));
+		tmp = ipv4_trie_find(node, f);
+		if (tmp) {
+			list_del_rcu(&tmp->node_list);
+			list_del(&tmp->list);
+			kfree_rcu(tmp, rcu);
+			ipv4_trie_prune(path, nr);
 		}
 	}
-	return 0;
+	mutex_unlock(&prov_filter_lock);
+out:
+	kfree(f);
+	return len < 0 ? len : 0;
 }
 
 /*!
- * @brief Add or update an element in the filter list that matches a specific
+ * @brief Add or update an element in the filter trie that matches a specific
  * filter.
  *
- * This function goes through a filter list,
- * and attempts to match the given filter.
+ * This function walks the filter trie to the prefix of the given filter,
+ * creating the missing nodes, and attempts to match the given filter.
  * If matched, the matched element's op value will be updated based on the given
- * filter @f or the element will be added if no matches.
- * @param filters The list to go through.
+ * filter @f (which is freed) or @f will be added if no matches.
+ * @param trie The trie to go through.
  * @param f The filter to match its mask, ip and port.
- * @return Always return 0.
+ * @return 0, -EINVAL if the mask is not contiguous or -ENOMEM.
  *
  */
-static inline uint8_t prov_ipv4_add_or_update(struct list_head *filters,
-					      struct ipv4_filters *f)
+static inline int prov_ipv4_add_or_update(struct ipv4_trie *trie,
+					  struct ipv4_filters *f)
 {
-	struct list_head *listentry, *listtmp;
+	struct ipv4_trie_node __rcu **path[PROV_IPV4_DEPTH];
+	uint32_t key = be32_to_cpu((__force __be32)f->filter.ip);
+	int len = prov_ipv4_prefix_len(f->filter.mask);
+	struct ipv4_trie_node *node;
 	struct ipv4_filters *tmp;
+	int rc = 0;
+	int nr;
 
-	list_for_each_safe(listentry, listtmp, filters) {
-		tmp = list_entry(listentry, struct ipv4_filters, list);
-		if (tmp->filter.mask == f->filter.mask &&
-		    tmp->filter.ip == f->filter.ip &&
-		    tmp->filter.port == f->filter.port) {
-			tmp->filter.op |= f->filter.op;
-			return 0; // you should only get one
+	if (len < 0) {
+		kfree(f);
+		return len;
+	}
+	mutex_lock(&prov_filter_lock);
+	nr = ipv4_trie_path(trie, key, len, path);
+	for (; nr <= len; nr++) {
+		node = kzalloc(sizeof(struct ipv4_trie_node), GFP_KERNEL);
+		if (!node) {
+			ipv4_trie_prune(path, nr);
+			kfree(f);
+			rc = -ENOMEM;
+			goto out;
 		}
+		INIT_LIST_HEAD(&node->filters);
+		rcu_assign_pointer(*path[nr], node);
+		if (nr < len)
+			path[nr + 1] = &node->child[ipv4_bit(key, nr)];
 	}
-	// If not already in the list, we add it.
-	list_add_tail(&(f->list), filters);
-	return 0;
+	node = rcu_dereference_protected(*path[len],
+					 lockdep_is_held(&prov_filter_lock));
+	tmp = ipv4_trie_find(node, f);
+	if (tmp) {
+		WRITE_ONCE(tmp->filter.op, tmp->filter.op | f->filter.op);
+		kfree(f);
+		goto out;
+	}
+	// If not already in the trie, we add it.
+	list_add_tail_rcu(&f->node_list, &node->filters);
+	list_add_tail(&f->list, &trie->filters);
+out:
+	mutex_unlock(&prov_filter_lock);
+	return rc;
 }
 
 /*!
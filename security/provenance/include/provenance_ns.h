@@ -15,19 +15,107 @@
 #ifndef _PROVENANCE_NS_H
 #define _PROVENANCE_NS_H
 
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+
+/* Number of namespaces in a filter */
+#define PROV_NS_FIELDS 6
+
 struct ns_filters {
 	struct list_head list;
 	struct nsinfo filter;
 };
 
+/*
+ * The ns_filters list is the policy as written by userspace; it is only
+ * accessed with prov_filter_lock held. It is compiled into an index used on
+ * the hook path: filters are grouped by shape (the set of namespaces that are
+ * not IGNORE_NS) and hashed on the namespaces of their shape, so that a
+ * lookup costs one probe per distinct shape.
+ */
 extern struct list_head ns_filters;
 
+struct prov_ns_slot {
+	// Namespaces, IGNORE_NS where the shape does not include them.
+	uint32_t ns[PROV_NS_FIELDS];
+	// Position of the filter in ns_filters (from 1), 0 if the slot is free.
+	uint32_t order;
+	uint8_t shape;
+	uint8_t op;
+};
+
+struct prov_ns_index {
+	struct rcu_head rcu;
+	uint32_t mask;
+	uint32_t nr_shapes;
+	uint8_t shapes[1 << PROV_NS_FIELDS];
+	struct prov_ns_slot slots[];
+};
+
+extern struct prov_ns_index __rcu *prov_ns_index;
+
+static __always_inline void ns_tuple(const struct nsinfo *f,
+				     uint32_t ns[PROV_NS_FIELDS])
+{
+	ns[0] = f->utsns;
+	ns[1] = f->ipcns;
+	ns[2] = f->mntns;
+	ns[3] = f->pidns;
+	ns[4] = f->netns;
+	ns[5] = f->cgroupns;
+}
+
+static __always_inline uint8_t ns_shape(const uint32_t ns[PROV_NS_FIELDS])
+{
+	uint8_t shape = 0;
+	int i;
+
+	for (i = 0; i < PROV_NS_FIELDS; i++)
+		if (ns[i] != IGNORE_NS)
+			shape |= 1 << i;
+	return shape;
+}
+
+/*!
+ * @brief Find the slot of a shape matching a namespace tuple, or the free
+ * slot where it would be inserted.
+ * @param index The compiled index.
+ * @param shape The shape to probe.
+ * @param ns The namespace tuple.
+ * @return The slot.
+ *
+ */
+static __always_inline struct prov_ns_slot *ns_probe(struct prov_ns_index *index,
+						     uint8_t shape,
+						     const uint32_t ns[PROV_NS_FIELDS])
+{
+	uint32_t key[PROV_NS_FIELDS];
+	struct prov_ns_slot *slot;
+	uint32_t h;
+	int i;
+
+	for (i = 0; i < PROV_NS_FIELDS; i++)
+		key[i] = (shape & (1 << i)) ? ns[i] : IGNORE_NS;
+	h = jhash2(key, PROV_NS_FIELDS, shape);
+	// The table is never more than half full.
+	for (;; h++) {
+		slot = &index->slots[h & index->mask];
+		if (!slot->order)
+			return slot;
+		if (slot->shape == shape && !memcmp(slot->ns, key, sizeof(key)))
+			return slot;
+	}
+}
+
 /*!
  * @brief Return the op value for a specific namespace filter in the ns_filters
  * list.
  *
  * The specific namespace filter must have the same values of the namespaces as
- * in the argument list or is IGNORE_NS.
+ * in the argument list or is IGNORE_NS. If several filters match, the one
+ * first in the list applies.
  * @param utsns UTS namespace.
  * @param ipcns Interprocess communication namespace.
  * @param mntns Mount namespace.
@@ -44,59 +132,124 @@ static inline uint8_t prov_ns_whichOP(uint32_t utsns,
 				      uint32_t netns,
 				      uint32_t cgroupns)
 {
-	struct list_head *listentry, *listtmp;
+	uint32_t ns[PROV_NS_FIELDS] = {utsns, ipcns, mntns,
+				       pidns, netns, cgroupns};
+	struct prov_ns_index *index;
+	struct prov_ns_slot *slot;
+	uint32_t order = 0;
+	uint8_t op = 0;
+	uint32_t i;
+
+	rcu_read_lock();
+	index = rcu_dereference(prov_ns_index);
+	if (!index)
+		goto out;
+	for (i = 0; i < index->nr_shapes; i++) {
+		slot = ns_probe(index, index->shapes[i], ns);
+		if (slot->order && (!order || slot->order < order)) {
+			order = slot->order;
+			op = slot->op;
+		}
+	}
+out:
+	rcu_read_unlock();
+	return op;
+}
+
+/*!
+ * @brief Compile the ns_filters list and replace the index used by lookups.
+ *
+ * Called with prov_filter_lock held.
+ * @return 0 or -ENOMEM (the previous index is kept).
+ *
+ */
+static inline int prov_ns_compile(void)
+{
+	struct prov_ns_index *index = NULL, *old;
+	struct prov_ns_slot *slot;
 	struct ns_filters *tmp;
+	uint32_t ns[PROV_NS_FIELDS];
+	uint64_t shapes = 0;
+	uint32_t nr = 0;
+	uint8_t shape;
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
-		if ((tmp->filter.cgroupns == cgroupns
-		     || tmp->filter.cgroupns == IGNORE_NS)
-		    && (tmp->filter.utsns == utsns
-			|| tmp->filter.utsns == IGNORE_NS)
-		    && (tmp->filter.ipcns == ipcns
-			|| tmp->filter.ipcns == IGNORE_NS)
-		    && (tmp->filter.mntns == mntns
-			|| tmp->filter.mntns == IGNORE_NS)
-		    && (tmp->filter.pidns == pidns
-			|| tmp->filter.pidns == IGNORE_NS)
-		    && (tmp->filter.netns == netns
-			|| tmp->filter.netns == IGNORE_NS))
-			return tmp->filter.op;
+	list_for_each_entry(tmp, &ns_filters, list)
+		nr++;
+	if (nr) {
+		index = kvzalloc(struct_size(index, slots,
+					     roundup_pow_of_two(2 * nr)),
+				 GFP_KERNEL);
+		if (!index)
+			return -ENOMEM;
+		index->mask = roundup_pow_of_two(2 * nr) - 1;
+		nr = 0;
+		list_for_each_entry(tmp, &ns_filters, list) {
+			ns_tuple(&tmp->filter, ns);
+			shape = ns_shape(ns);
+			slot = ns_probe(index, shape, ns);
+			memcpy(slot->ns, ns, sizeof(ns));
+			slot->order = ++nr;
+			slot->shape = shape;
+			slot->op = tmp->filter.op;
+			if (!(shapes & BIT_ULL(shape))) {
+				shapes |= BIT_ULL(shape);
+				index->shapes[index->nr_shapes++] = shape;
+			}
+		}
 	}
+	old = rcu_replace_pointer(prov_ns_index, index,
+				  lockdep_is_held(&prov_filter_lock));
+	if (old)
+		kvfree_rcu(old, rcu);
 	return 0;
 }
 
+static __always_inline bool ns_filter_equal(const struct nsinfo *a,
+					    const struct nsinfo *b)
+{
+	return a->cgroupns == b->cgroupns
+	       && a->utsns == b->utsns
+	       && a->ipcns == b->ipcns
+	       && a->mntns == b->mntns
+	       && a->pidns == b->pidns
+	       && a->netns == b->netns;
+}
+
 /*!
  * @brief Remove a specific namespace filter in the ns_filters list.
  *
  * The specific namespace filter must have the same values as the ns_filter
- * in the argument list.
+ * in the argument list. The index is compiled again, the filter given in
+ * argument is freed.
  * @postcondition At most one element should be removed in the list.
  * @param f The ns_filter that is checked against to remove the filter in the
  * list.
- * @return 0 if no error occurred. Other error codes unknown.
+ * @return 0 if no error occurred, -ENOMEM if the index could not be compiled
+ * (the list is left unchanged).
  *
  */
-static inline uint8_t prov_ns_delete(struct ns_filters *f)
+static inline int prov_ns_delete(struct ns_filters *f)
 {
-	struct list_head *listentry, *listtmp;
 	struct ns_filters *tmp;
+	struct list_head *prev;
+	int rc = 0;
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
-		if (tmp->filter.cgroupns == f->filter.cgroupns
-		    && tmp->filter.utsns == f->filter.utsns
-		    && tmp->filter.ipcns == f->filter.ipcns
-		    && tmp->filter.mntns == f->filter.mntns
-		    && tmp->filter.pidns == f->filter.pidns
-		    && tmp->filter.netns == f->filter.netns
-		    ) {
-			list_del(listentry);
-			kfree(tmp);
-			return 0; // You should only get one
+	mutex_lock(&prov_filter_lock);
+	list_for_each_entry(tmp, &ns_filters, list) {
+		if (ns_filter_equal(&tmp->filter, &f->filter)) {
+			prev = tmp->list.prev;
+			list_del(&tmp->list);
+			rc = prov_ns_compile();
+			if (rc)
+				list_add(&tmp->list, prev);
+			else
+				kfree(tmp);
+			break; // You should only get one
 		}
 	}
-	return 0;
+	mutex_unlock(&prov_filter_lock);
+	kfree(f);
+	return rc;
 }
 
 
@@ -108,32 +261,41 @@ static inline uint8_t prov_ns_delete(struct ns_filters *f)
  * the argument list.
  * The op value is updated to the same as the ns_filters in the argument list.
  * If we cannot find the matching filter in the list, we add the filter at the
- * tail end of the list.
+ * tail end of the list. The index is compiled again, the filter given in
+ * argument is either inserted or freed.
  * @postcondition At most one element should be updated in the list.
  * @param f The ns_filter that is checked against to update the filter in the
  * list.
- * @return 0 if no error occurred. Other error codes unknown.
+ * @return 0 if no error occurred, -ENOMEM if the index could not be compiled
+ * (the list is left unchanged).
  *
  */
-static inline uint8_t prov_ns_add_or_update(struct ns_filters *f)
+static inline int prov_ns_add_or_update(struct ns_filters *f)
 {
-	struct list_head *listentry, *listtmp;
 	struct ns_filters *tmp;
+	uint8_t op;
+	int rc;
 
-	list_for_each_safe(listentry, listtmp, &ns_filters) {
-		tmp = list_entry(listentry, struct ns_filters, list);
-		if (tmp->filter.cgroupns == f->filter.cgroupns
-		    && tmp->filter.utsns == f->filter.utsns
-		    && tmp->filter.ipcns == f->filter.ipcns
-		    && tmp->filter.mntns == f->filter.mntns
-		    && tmp->filter.pidns == f->filter.pidns
-		    && tmp->filter.netns == f->filter.netns
-		    ) {
+	mutex_lock(&prov_filter_lock);
+	list_for_each_entry(tmp, &ns_filters, list) {
+		if (ns_filter_equal(&tmp->filter, &f->filter)) {
+			op = tmp->filter.op;
 			tmp->filter.op = f->filter.op;
-			return 0; // You should only get one
+			rc = prov_ns_compile();
+			if (rc)
+				tmp->filter.op = op;
+			mutex_unlock(&prov_filter_lock);
+			kfree(f);
+			return rc; // You should only get one
 		}
 	}
 	list_add_tail(&(f->list), &ns_filters);
-	return 0;
+	rc = prov_ns_compile();
+	if (rc) {
+		list_del(&f->list);
+		kfree(f);
+	}
+	mutex_unlock(&prov_filter_lock);
+	return rc;
 }
 #endif
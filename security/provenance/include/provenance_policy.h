@@ -15,6 +15,8 @@
 #ifndef _PROVENANCE_POLICY_H
 #define _PROVENANCE_POLICY_H
 
+#include <linux/mutex.h>
+
 /*!
  * @brief provenance capture policy defined by the user.
  *
@@ -31,6 +33,13 @@ struct capture_policy {
 	// every time a relation is recorded the two end nodes will be recorded
 	// again if set to true.
 	bool should_duplicate;
+	// Whether the arguments and environment of an exec are recorded as
+	// packed ENT_ARGS entries rather than one entry per string (opt-in,
+	// through the "pack_args" file).
+	bool should_pack_args;
+	// Window (ms) over which repeated relations are aggregated, 0 if
+	// relations are not aggregated.
+	uint32_t aggregate_window;
 	// Node to be filtered out (i.e., not recorded).
 	uint64_t prov_node_filter;
 	// Node to be filtered out if it is part of propagate.
@@ -59,4 +68,11 @@ struct capture_policy {
 
 extern struct capture_policy prov_policy;
 
+/*
+ * Serialises updates of the uid, gid, secctx and ns filters. Lookups on the
+ * hook path are lock-free (RCU), readers that can sleep (e.g. to copy the
+ * filters to userspace) take the lock.
+ */
+extern struct mutex prov_filter_lock;
+
 #endif
@@ -17,60 +17,83 @@
 
 #include <linux/provenance_query.h>
 
+#include <linux/jump_label.h>
+#include <linux/rculist.h>
+
 int init_prov_propagate(void);
+int prov_propagate_flow(prov_entry_t *from,
+			prov_entry_t *edge,
+			prov_entry_t *to);
 
-static inline int call_provenance_flow(prov_entry_t *from,
-				       prov_entry_t *edge,
-				       prov_entry_t *to)
-{
-	int rc = 0;
-	struct list_head *listentry, *listtmp;
-	struct provenance_query_hooks *fcn;
+/*
+ * Enabled while at least one hook is registered.
+ * prov_query_list_key is enabled while hooks other than the built-in propagate
+ * hook are registered; otherwise prov_propagate_flow is called directly.
+ */
+DECLARE_STATIC_KEY_FALSE(prov_query_key);
+DECLARE_STATIC_KEY_FALSE(prov_query_list_key);
+// Enabled while at least one hook has an observe function.
+DECLARE_STATIC_KEY_FALSE(prov_query_observe_key);
 
-	list_for_each_safe(listentry, listtmp, &provenance_query_hooks) {
-		fcn = list_entry(listentry, struct provenance_query_hooks,
-				 list);
-		if (fcn->flow)
-			rc |= fcn->flow(from, edge, to);
-	}
-	return rc;
-}
+/* Per-CPU buffer of flows for observers (entries, power of two) */
+#define PROV_OBSERVE_RING 128
 
-static inline int call_provenance_alloc(prov_entry_t *elt)
-{
-	int rc = 0;
-	struct list_head *listentry, *listtmp;
-	struct provenance_query_hooks *fcn;
+void prov_observe(prov_entry_t *from, prov_entry_t *edge, prov_entry_t *to);
 
-	list_for_each_safe(listentry, listtmp, &provenance_query_hooks) {
-		fcn = list_entry(listentry, struct provenance_query_hooks,
-				 list);
-		if (fcn->alloc)
-			rc |= fcn->alloc(elt);
+#define declare_call_query_list(function_name, hook, args, ...)		 \
+	static inline int function_name(__VA_ARGS__)			 \
+	{								 \
+		int rc = 0;						 \
+		struct provenance_query_hooks *fcn;			 \
+		rcu_read_lock();					 \
+		list_for_each_entry_rcu(fcn, &provenance_query_hooks, list) { \
+			if (fcn->hook)					 \
+				rc |= fcn->hook args;			 \
+		}							 \
+		rcu_read_unlock();					 \
+		return rc;						 \
 	}
-	return rc;
+
+declare_call_query_list(__call_provenance_flow, flow, (from, edge, to),
+			prov_entry_t *from, prov_entry_t *edge,
+			prov_entry_t *to);
+declare_call_query_list(__call_provenance_alloc, alloc, (elt),
+			prov_entry_t *elt);
+declare_call_query_list(__call_provenance_free, free, (elt),
+			prov_entry_t *elt);
+
+static __always_inline int call_provenance_flow(prov_entry_t *from,
+						prov_entry_t *edge,
+						prov_entry_t *to)
+{
+	if (!static_branch_unlikely(&prov_query_key))
+		return 0;
+	if (!static_branch_unlikely(&prov_query_list_key))
+		return prov_propagate_flow(from, edge, to);
+	return __call_provenance_flow(from, edge, to);
 }
 
-static inline int call_provenance_free(prov_entry_t *elt)
+static __always_inline int call_provenance_alloc(prov_entry_t *elt)
 {
-	int rc = 0;
-	struct list_head *listentry, *listtmp;
-	struct provenance_query_hooks *fcn;
+	// The propagate hook has no alloc function.
+	if (!static_branch_unlikely(&prov_query_list_key))
+		return 0;
+	return __call_provenance_alloc(elt);
+}
 
-	list_for_each_safe(listentry, listtmp, &provenance_query_hooks) {
-		fcn = list_entry(listentry, struct provenance_query_hooks,
-				 list);
-		if (fcn->free)
-			rc |= fcn->free(elt);
-	}
-	return rc;
+static __always_inline int call_provenance_free(prov_entry_t *elt)
+{
+	// The propagate hook has no free function.
+	if (!static_branch_unlikely(&prov_query_list_key))
+		return 0;
+	return __call_provenance_free(elt);
 }
 
 /*!
  * @brief Call out_edge and in_edge function.
  *
  * Simply call both call_provenance_out_edge and call_provenance_in_edge
- * function.
+ * function. The flow is then queued for asynchronous observers, if any.
  * @param from The source node provenance entry pointer.
  * @param to The destination node provenance entry pointer.
  * @param edge The edge provenance entry pointer.
@@ -90,8 +113,12 @@ static inline int call_query_hooks(prov_entry_t *from,
 	if ((rc & PROVENANCE_PREVENT_FLOW) == PROVENANCE_PREVENT_FLOW) {
 		pr_err("Provenance: error raised.\n");
 		edge->relation_info.allowed = FLOW_DISALLOWED;
-		return -EPERM;
+		rc = -EPERM;
+	} else {
+		rc = 0;
 	}
-	return 0;
+	if (static_branch_unlikely(&prov_query_observe_key))
+		prov_observe(from, edge, to);
+	return rc;
 }
 #endif
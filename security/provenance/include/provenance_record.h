@@ -17,6 +17,8 @@
 
 #include "provenance.h"
 #include "provenance_relay.h"
+#include "provenance_aggregate.h"
+#include "provenance_intern.h"
 #include "memcpy_ss.h"
 
 /*!
@@ -61,6 +63,9 @@ static __always_inline int __update_version(const uint64_t type,
 	if (filter_update_node(type))
 		return 0;
 
+	// Relations pending for this version are emitted first.
+	prov_aggregate_flush(prov);
+
 	// Copy the current provenance prov to old_prov.
 	__memcpy_ss(&old_prov, sizeof(union prov_elt),
 		    prov, sizeof(union prov_elt));
@@ -83,6 +88,29 @@ static __always_inline int __update_version(const uint64_t type,
 	return rc;
 }
 
+/*!
+ * @brief Same as "__write_relation", but the relation is held back to be
+ * aggregated with its repetitions (see aggregate.c).
+ */
+static __always_inline int __aggregate_relation(const uint64_t type,
+						prov_entry_t *from,
+						prov_entry_t *to,
+						const struct file *file,
+						const uint64_t flags)
+{
+	union prov_elt relation;
+	int rc;
+
+	if (!should_record_relation(type, from, to))
+		return 0;
+	__write_node(from);
+	__write_node(to);
+	__prepare_relation(type, &relation, from, to, file, flags);
+	rc = call_query_hooks(from, to, (prov_entry_t *)&relation);
+	prov_aggregate_insert(&relation);
+	return rc;
+}
+
 /*!
  * @brief This function records a provenance relation (i.e., edge) between two
  * provenance nodes unless certain criteria are met.
@@ -101,6 +129,9 @@ static __always_inline int __update_version(const uint64_t type,
  * 2. The type of the edges being recorded are the same as before (we only
  * compress same edges that occurs consecutively on the two nodes).
  * The relation is recorded by calling the "__write_relation" function.
+ * If relations are aggregated, a repetition of a pending relation is only
+ * counted, and new relations are held back (see aggregate.c); this
+ * supersedes edge compression.
  * @param type The type of the relation
  * @param from The pointer to the source provenance node
  * @param to The pointer to the destination provenance node
@@ -119,6 +150,16 @@ static __always_inline int record_relation(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_type_is_relation(type));
 
+	if (prov_policy.aggregate_window && !filter_update_node(type)) {
+		if (prov_aggregate_hit(type, from, to))
+			return 0;
+		rc = __update_version(type, to);
+		if (rc < 0)
+			return rc;
+		set_has_outgoing(from);
+		return __aggregate_relation(type, from, to, file, flags);
+	}
+
 	if (prov_policy.should_compress_edge) {
 		if (node_previous_id(to) == node_identifier(from).id
 		    && node_previous_type(to) == type)
@@ -161,6 +202,8 @@ static __always_inline int record_terminate(uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_close(type));
 
+	// The node changes version or is freed.
+	prov_aggregate_flush(prov_entry(prov));
 	if (!provenance_is_recorded(prov_elt(prov)) && !prov_policy.prov_all)
 		return 0;
 	if (filter_node(prov_entry(prov)))
@@ -195,6 +238,10 @@ static __always_inline int record_terminate(uint64_t type,
  * Recording the relation is located in a critical section.
  * No other thread can update the node in question, when its named is being
  * attached.
+ * If the name node has already been written in this epoch (see intern.c),
+ * it is marked as recorded so that only the relation is written; the name
+ * node is still complete for the hooks that observe the relation.
+ * A name node is only interned if no channel filter dropped it.
  * @param node The provenance node to which we create a new name node and a
  * naming relation between them.
  * @param name The name of the provenance node.
@@ -207,6 +254,10 @@ static __always_inline int record_node_name(struct provenance *node,
 					    bool force)
 {
 	union long_prov_elt *fname_prov;
+	uint64_t hash;
+	uint32_t check;
+	bool interned;
+	int gen;
 	int rc;
 
 	if (provenance_is_opaque(prov_elt(node)))
@@ -216,13 +267,23 @@ static __always_inline int record_node_name(struct provenance *node,
 	    || !provenance_is_recorded(prov_elt(node)))
 		return 0;
 
-	fname_prov = alloc_long_provenance(ENT_PATH, djb2_hash(name));
+	hash = djb2_hash(name);
+	fname_prov = alloc_long_provenance(ENT_PATH, hash);
 	if (!fname_prov)
 		return -ENOMEM;
 
 	strlcpy(fname_prov->file_name_info.name, name, PATH_MAX);
 	fname_prov->file_name_info.length =
 		strnlen(fname_prov->file_name_info.name, PATH_MAX);
+	// A recorded node is not written again (unless duplicated).
+	check = prov_intern_check(fname_prov->file_name_info.name,
+				  fname_prov->file_name_info.length);
+	interned = !prov_policy.should_duplicate &&
+		   prov_path_interned(hash, check);
+	if (interned)
+		set_recorded(fname_prov);
+	// Read before the node is written, see prov_path_intern.
+	gen = prov_intern_generation();
 
 	// Here we record the relation.
 	spin_lock(prov_lock(node));
@@ -230,6 +291,9 @@ static __always_inline int record_node_name(struct provenance *node,
 			     prov_entry(node), NULL, 0);
 	set_name_recorded(prov_elt(node));
 	spin_unlock(prov_lock(node));
+	if (!interned && provenance_is_recorded(fname_prov)
+	    && prov_channels_accept(fname_prov))
+		prov_path_intern(hash, check, gen);
 	free_long_provenance(fname_prov);
 	return rc;
 }
@@ -287,9 +351,9 @@ static __always_inline int uses(const uint64_t type,
 	BUILD_BUG_ON(!prov_is_used(type));
 
 	// Check if the nodes match some capture options.
-	apply_target(prov_elt(entity));
-	apply_target(prov_elt(activity));
-	apply_target(prov_elt(activity_mem));
+	apply_target(entity);
+	apply_target(activity);
+	apply_target(activity_mem);
 
 	if (provenance_is_opaque(prov_elt(entity))
 	    || provenance_is_opaque(prov_elt(activity))
@@ -346,8 +410,8 @@ static __always_inline int uses_two(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_used(type));
 
-	apply_target(prov_elt(entity));
-	apply_target(prov_elt(activity));
+	apply_target(entity);
+	apply_target(activity);
 
 	if (provenance_is_opaque(prov_elt(entity))
 	    || provenance_is_opaque(prov_elt(activity)))
@@ -404,9 +468,9 @@ static __always_inline int generates(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_generated(type));
 
-	apply_target(prov_elt(activity_mem));
-	apply_target(prov_elt(activity));
-	apply_target(prov_elt(entity));
+	apply_target(activity_mem);
+	apply_target(activity);
+	apply_target(entity);
 
 	if (provenance_is_tracked(prov_elt(activity_mem)))
 		set_tracked(prov_elt(activity));
@@ -473,8 +537,8 @@ static __always_inline int derives(const uint64_t type,
 {
 	BUILD_BUG_ON(!prov_is_derived(type));
 
-	apply_target(prov_elt(from));
-	apply_target(prov_elt(to));
+	apply_target(from);
+	apply_target(to);
 
 	if (provenance_is_opaque(prov_elt(from))
 	    || provenance_is_opaque(prov_elt(to)))
@@ -522,8 +586,8 @@ static __always_inline int informs(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_informed(type));
 
-	apply_target(prov_elt(from));
-	apply_target(prov_elt(to));
+	apply_target(from);
+	apply_target(to);
 
 	if (provenance_is_opaque(prov_elt(from))
 	    || provenance_is_opaque(prov_elt(to)))
@@ -554,8 +618,8 @@ static __always_inline int record_influences_kernel(const uint64_t type,
 
 	BUILD_BUG_ON(!prov_is_influenced(type));
 
-	apply_target(prov_elt(entity));
-	apply_target(prov_elt(activity));
+	apply_target(entity);
+	apply_target(activity);
 
 	if (provenance_is_opaque(prov_elt(entity))
 	    || provenance_is_opaque(prov_elt(activity)))
@@ -20,6 +20,7 @@
 #include <linux/jiffies.h>
 #include <linux/list.h>
 #include <uapi/linux/provenance.h>
+#include <uapi/linux/provenance_fs.h>
 
 #include "provenance_filter.h"
 #include "provenance_query.h"
@@ -29,34 +30,59 @@
 #define PROV_RELAY_BUFF_SIZE ((1 << PROV_RELAY_BUFF_EXP) * sizeof(uint8_t))
 #define PROV_NB_SUBBUF 64
 
-struct boot_buffer {
-	struct list_head list;
-	union prov_elt msg;
-};
-
-struct long_boot_buffer {
-	struct list_head list;
-	union long_prov_elt msg;
-};
+/* Default per-CPU staging ring sizes (entries), see provenance_ring= */
+#define PROV_RING_SIZE 1024
+#define PROV_LONG_RING_SIZE 32
+/* Default per-CPU shared log sizes (entries), see provenance_log= */
+#define PROV_LOG_SIZE 8192
+#define PROV_LONG_LOG_SIZE 256
+/* Maximum number of entries moved to relay before rescheduling */
+#define PROV_RING_BATCH 64
+/* Default per-CPU boot buffer sizes (entries), see provenance_boot= */
+#ifdef CONFIG_SECURITY_PROVENANCE_BOOT
+#define PROV_BOOT_RING_SIZE 4096
+#define PROV_LONG_BOOT_RING_SIZE 64
+#else
+#define PROV_BOOT_RING_SIZE 256
+#define PROV_LONG_BOOT_RING_SIZE 16
+#endif
+/* Default time contexts that can sleep wait for room, see provenance_overflow= */
+#define PROV_OVERFLOW_WAIT_MS 10
+/* Drop counters: 49 subtype slots (none or one bit) for nodes and each
+ * relation category. */
+#define PROV_DROP_SUBTYPES 49
+#define PROV_DROP_SLOTS (7 * PROV_DROP_SUBTYPES)
 
 int prov_create_channel(char *buffer, size_t len);
+void prov_boot_buffer_init(void);
 void write_boot_buffer(void);
-bool is_relay_full(struct rchan *chan);
-void prov_add_relay(char *name, struct rchan *prov, struct rchan *long_prov);
 void prov_flush(void);
+void prov_ring_flush(void);
+size_t prov_ring_info(struct prov_ring_info *info, size_t nr);
+size_t prov_channel_info(struct prov_channel_info *info, size_t nr);
+size_t prov_drop_info(struct prov_drop_info *info, size_t nr);
 
-extern struct kmem_cache *boot_buffer_cache;
-extern spinlock_t lock_buffer;
-extern struct list_head buffer_list;
+extern bool relay_ready;
+extern struct prov_overflow_policy prov_overflow;
 
-extern struct kmem_cache *long_boot_buffer_cache;
-extern spinlock_t lock_long_buffer;
-extern struct list_head long_buffer_list;
+void __prov_throttle(void);
 
-extern bool relay_ready;
+/*!
+ * @brief Under PROV_OVERFLOW_THROTTLE, let the consumer catch up before a hook
+ * records anything (see __prov_throttle).
+ *
+ * Must be called before any provenance lock is taken.
+ */
+static __always_inline void prov_throttle(void)
+{
+	if (unlikely(READ_ONCE(prov_overflow.mode) == PROV_OVERFLOW_THROTTLE))
+		__prov_throttle();
+}
 
 void prov_write(union prov_elt *msg, size_t size);
 void long_prov_write(union long_prov_elt *msg, size_t size);
+bool prov_channels_accept(const void *msg);
+void prov_sample_task(prov_entry_t *node);
 
 static __always_inline void tighten_identifier(union prov_identifier *id)
 {
@@ -85,6 +111,8 @@ static __always_inline void tighten_identifier(union prov_identifier *id)
  *              record the machine and boot ID because during boot it is
  * possible that these information is not ready yet (in camconfd) and need to be
  * set again here.
+ * Performance counters of a task node are sampled here, when the node is
+ * written, rather than on every hook (see prov_sample_task).
  * @param node Provenance node (could be either regular or long)
  *
  */
@@ -95,6 +123,8 @@ static __always_inline void __write_node(prov_entry_t *node)
 	if (provenance_is_recorded(node) && !prov_policy.should_duplicate)
 		return;
 	tighten_identifier(&get_prov_identifier(node));
+	if (node_type(node) == ACT_TASK)
+		prov_sample_task(node);
 	set_recorded(node);
 	if (prov_type_is_long(node_type(node)))
 		long_prov_write(node, sizeof(union long_prov_elt));
@@ -25,6 +25,8 @@
 #include <linux/ipc_namespace.h>
 #include <linux/mnt_namespace.h>
 #include <linux/mm.h> // used for get_page
+#include <linux/mmap_lock.h>
+#include <linux/fs_struct.h>
 #include <net/net_namespace.h>
 #include <linux/pid_namespace.h>
 #include <linux/sched/cputime.h>
@@ -39,6 +41,9 @@
 #define MB              (1024 * KB)
 #define KB_MASK         (~(KB - 1))
 
+/* Maximum number of strings in a packed ENT_ARGS entry */
+#define PROV_ARGS_MAX   128
+
 /*!
  * @summary The following current_XXX functions are to obtain XXX
  * information of the current process.
@@ -147,6 +152,32 @@ static inline uint32_t current_pidns(void)
 	return id;
 }
 
+/*!
+ * @brief Check the namespaces recorded in @prov against the current task.
+ *
+ * Only the current task replaces its nsproxy, so it is read without
+ * task_lock. The namespace identifiers are compared rather than the nsproxy,
+ * as a freed nsproxy can be reallocated at the same address.
+ * @param prov The cred provenance node of the current task.
+ * @return true if the recorded namespaces are those of the current task.
+ *
+ */
+static inline bool current_ns_recorded(struct provenance *prov)
+{
+	struct nsproxy *nsproxy = READ_ONCE(current->nsproxy);
+	struct pid_namespace *pidns = task_active_pid_ns(current);
+
+	if (!nsproxy || !pidns)
+		return false;
+	return prov_elt(prov)->proc_info.utsns == nsproxy->uts_ns->ns.inum
+	       && prov_elt(prov)->proc_info.ipcns == nsproxy->ipc_ns->ns.inum
+	       && prov_elt(prov)->proc_info.mntns == nsproxy->mnt_ns->ns.inum
+	       && prov_elt(prov)->proc_info.netns == nsproxy->net_ns->ns.inum
+	       && prov_elt(prov)->proc_info.cgroupns
+	       == nsproxy->cgroup_ns->ns.inum
+	       && prov_elt(prov)->proc_info.pidns == pidns->ns.inum;
+}
+
 #define vm_write(flags) ((flags & VM_WRITE) == VM_WRITE)
 #define vm_read(flags) ((flags & VM_READ) == VM_READ)
 #define vm_exec(flags) ((flags & VM_EXEC) == VM_EXEC)
@@ -155,19 +186,137 @@ static inline uint32_t current_pidns(void)
 #define vm_read_exec_mayshare(flags) \
 	((vm_read(flags) || vm_exec(flags)) && vm_mayshare(flags))
 
+/*
+ * Shared file mappings of an mm, cached per task so that current_update_shst
+ * does not walk every VMA. The cache is checked against the mm before use,
+ * which also covers mappings installed after the mmap_file hook:
+ * 1. the VMA sequence number of the mm must not have changed (bumped when a
+ * VMA is removed, including when a MAP_FIXED mapping replaces it);
+ * 2. the number of VMAs must not have changed (a mapping is added);
+ * 3. every cached mapping must still be a VMA with the same bounds and file
+ * (a split, merge or move changes the bounds).
+ * An mm with more than PROV_SHMAP_MAX shared file mappings is not cached.
+ */
+struct prov_shmap {
+	struct mm_struct *mm;
+	u64 seqnum;
+	int map_count;
+	unsigned int nr;
+	struct prov_shmap_entry {
+		unsigned long start;
+		unsigned long end;
+		struct file *file;
+		vm_flags_t flags;
+	} maps[];
+};
+
+/* Maximum number of cached mappings, so that the cache fits in a page */
+#define PROV_SHMAP_MAX \
+	((PAGE_SIZE - sizeof(struct prov_shmap)) \
+	 / sizeof(struct prov_shmap_entry))
+
+/*!
+ * @brief Check a cached list of shared mappings against an mm, and refresh
+ * the flags of the mappings.
+ *
+ * Called with the mmap lock held.
+ */
+static inline bool shmap_valid(struct prov_shmap *shmap, struct mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+	unsigned int i;
+
+	if (shmap->mm != mm
+	    || shmap->seqnum != mm->vmacache_seqnum
+	    || shmap->map_count != mm->map_count)
+		return false;
+	for (i = 0; i < shmap->nr; i++) {
+		vma = find_vma(mm, shmap->maps[i].start);
+		if (!vma
+		    || vma->vm_start != shmap->maps[i].start
+		    || vma->vm_end != shmap->maps[i].end
+		    || vma->vm_file != shmap->maps[i].file
+		    || !vm_mayshare(vma->vm_flags))
+			return false;
+		shmap->maps[i].flags = vma->vm_flags;
+	}
+	return true;
+}
+
+/*!
+ * @brief Build the list of shared file mappings of an mm.
+ *
+ * Called with the mmap lock held, from contexts that cannot sleep.
+ * @return The list or NULL if it could not be allocated or the mm has more
+ * than PROV_SHMAP_MAX shared file mappings.
+ *
+ */
+static inline struct prov_shmap *shmap_build(struct mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+	struct prov_shmap *shmap;
+	unsigned int nr = 0;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next)
+		if (vma->vm_file && vm_mayshare(vma->vm_flags)
+		    && ++nr > PROV_SHMAP_MAX)
+			return NULL;
+	shmap = kmalloc(struct_size(shmap, maps, nr), GFP_ATOMIC);
+	if (!shmap)
+		return NULL;
+	shmap->mm = mm;
+	shmap->seqnum = mm->vmacache_seqnum;
+	shmap->map_count = mm->map_count;
+	shmap->nr = 0;
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!vma->vm_file || !vm_mayshare(vma->vm_flags))
+			continue;
+		shmap->maps[shmap->nr].start = vma->vm_start;
+		shmap->maps[shmap->nr].end = vma->vm_end;
+		shmap->maps[shmap->nr].file = vma->vm_file;
+		shmap->maps[shmap->nr].flags = vma->vm_flags;
+		shmap->nr++;
+	}
+	return shmap;
+}
+
+static __always_inline int record_shst(struct provenance *cprov,
+				       struct file *mmapf,
+				       vm_flags_t flags,
+				       bool read)
+{
+	struct provenance *mmprov = get_file_provenance(mmapf, false);
+	int rc = 0;
+
+	if (!mmprov)
+		return 0;
+	if (vm_read_exec_mayshare(flags) && read)
+		rc = record_relation(RL_SH_READ,
+				     prov_entry(mmprov),
+				     prov_entry(cprov),
+				     mmapf,
+				     flags);
+	if (vm_write_mayshare(flags) && !read)
+		rc = record_relation(RL_SH_WRITE,
+				     prov_entry(cprov),
+				     prov_entry(mmprov),
+				     mmapf,
+				     flags);
+	return rc;
+}
+
 /*!
  * @brief Record shared mmap relations of a process.
  *
- * The function goes through all the mmapped files of the "current" process,
- * and for every shared mmaped file,
- * if the mmapped file has provenance entry,
- * record provenance relation between the mmaped file and the current process
- * based on the permission flags and the action (read, exec, or write).
- * If read/exec, record provenance relation RL_SH_READ by calling
- * "record_relation" function.
- * If write, record provenance relation RL_SH_WRITE by calling "record_relation"
- * function.
- * @param cprov The cred provenance entry pointer of the current process.
+ * The function goes through the shared mmapped files of the "current"
+ * process (see struct prov_shmap), and for each of those files:
+ * 1. Record a RL_SH_READ relation if the file is readable or executable, and
+ * "read" is true, or
+ * 2. Record a RL_SH_WRITE relation if the file is writable and "read" is
+ * false.
+ * If the mmap lock cannot be taken, or the list cannot be built (see
+ * shmap_build), every VMA is visited instead.
+ * @param cprov The cred provenance node of the "current" process.
  * @param read Whether the operation is read or not.
  * @return 0 if no error occurred or "mm" is NULL; Other error codes inherited
  * from record_relation function or unknown.
@@ -177,41 +326,115 @@ static __always_inline int current_update_shst(struct provenance *cprov,
 					       bool read)
 {
 	struct mm_struct *mm = get_task_mm(current);
+	struct prov_shmap **cache = provenance_task_shmap(current);
 	struct vm_area_struct *vma;
-	struct file *mmapf;
-	vm_flags_t flags;
-	struct provenance *mmprov;
+	struct prov_shmap *shmap;
+	unsigned int i;
 	int rc = 0;
 
 	if (!mm)
 		return rc;
+	if (mmap_read_trylock(mm)) {
+		shmap = *cache;
+		if (!shmap || !shmap_valid(shmap, mm)) {
+			kfree(shmap);
+			shmap = shmap_build(mm);
+			*cache = shmap;
+		}
+		if (shmap) {
+			for (i = 0; i < shmap->nr; i++)
+				rc = record_shst(cprov, shmap->maps[i].file,
+						 shmap->maps[i].flags, read);
+			mmap_read_unlock(mm);
+			goto out;
+		}
+		mmap_read_unlock(mm);
+	}
 	vma = mm->mmap;
 	while (vma) { // We go through all the mmaped files.
-		mmapf = vma->vm_file;
-		if (mmapf) {
-			flags = vma->vm_flags;
-			mmprov = get_file_provenance(mmapf, false);
-			if (mmprov) {
-				if (vm_read_exec_mayshare(flags) && read)
-					rc = record_relation(RL_SH_READ,
-							     prov_entry(mmprov),
-							     prov_entry(cprov),
-							     mmapf,
-							     flags);
-				if (vm_write_mayshare(flags) && !read)
-					rc = record_relation(RL_SH_WRITE,
-							     prov_entry(cprov),
-							     prov_entry(mmprov),
-							     mmapf,
-							     flags);
-			}
-		}
+		if (vma->vm_file)
+			rc = record_shst(cprov, vma->vm_file, vma->vm_flags,
+					 read);
 		vma = vma->vm_next;
 	}
+out:
 	mmput_async(mm);        // Release the file.
 	return rc;
 }
 
+/*!
+ * @brief Name @prov after the executable @exe_file.
+ *
+ * The path of the executable is resolved once and cached on its inode, so
+ * that naming a process is usually a lookup. The cached path is reused by
+ * tasks with the same root and dropped when the inode is renamed or unlinked
+ * (see invalidate_exe_name); it is resolved again after any directory is
+ * renamed, or a root or mount changes (see invalidate_exe_names).
+ * @param prov The provenance entry to be named.
+ * @param exe_file The executable of the current task.
+ * @return 0 if no error occurred; -ENOMEM if no memory can be allocated for
+ * buffer to hold file path. Other error codes from file_path.
+ *
+ */
+static inline int record_exe_name(struct provenance *prov,
+				  struct file *exe_file)
+{
+	struct prov_exe_name __rcu **slot =
+		provenance_inode_exe_name(file_inode(exe_file));
+	int generation = atomic_read(&prov_exe_name_generation);
+	struct fs_struct *fs = current->fs;
+	struct prov_exe_name *name;
+	struct path root = {};
+	char *buffer;
+	char *ptr;
+	size_t len;
+	int rc;
+
+	if (fs) {
+		spin_lock(&fs->lock);
+		root = fs->root;
+		spin_unlock(&fs->lock);
+	}
+	rcu_read_lock();
+	name = rcu_dereference(*slot);
+	if (name && fs
+	    && name->generation == generation
+	    && name->root_dentry == root.dentry
+	    && name->root_mnt == root.mnt) {
+		rc = record_node_name(prov, name->name, false);
+		rcu_read_unlock();
+		return rc;
+	}
+	rcu_read_unlock();
+
+	// Memory allocation not allowed to sleep.
+	buffer = kcalloc(PATH_MAX, sizeof(char), GFP_ATOMIC);
+	if (!buffer)
+		return -ENOMEM;
+	ptr = file_path(exe_file, buffer, PATH_MAX);
+	if (IS_ERR(ptr)) {
+		rc = PTR_ERR(ptr);
+		goto out;
+	}
+	rc = record_node_name(prov, ptr, false);
+	if (!fs)
+		goto out;
+	len = buffer + PATH_MAX - ptr;
+	name = kmalloc(struct_size(name, name, len), GFP_ATOMIC);
+	if (!name)
+		goto out;
+	name->root_dentry = root.dentry;
+	name->root_mnt = root.mnt;
+	name->generation = generation;
+	memcpy(name->name, ptr, len);
+	name = xchg((__force struct prov_exe_name **)slot, name);
+	if (name)
+		kfree_rcu(name, rcu);
+out:
+	kfree(buffer);
+	return rc;
+}
+
 /*!
  * @brief Record the name of the task @task, and associate the name to the
  * provenance entry @prov by creating a relation by calling "record_node_name"
@@ -219,7 +442,7 @@ static __always_inline int current_update_shst(struct provenance *cprov,
  *
  * Unless failure occurs or certain criteria are met,
  * we obtain the name of the task from its "mm_exe_file", and create a
- * RL_NAMED_PROCESS relation by calling "record_node_name" function.
+ * RL_NAMED_PROCESS relation by calling "record_exe_name" function.
  * Criteria to be met so as not to record task name are:
  * 1. The name of the provenance node has already been recorded, or
  * 2. The provenance node itself is not recorded, or
@@ -238,8 +461,6 @@ static inline int record_task_name(struct task_struct *task,
 	struct provenance *fprov;
 	struct mm_struct *mm;
 	struct file *exe_file;
-	char *buffer;
-	char *ptr;
 	int rc = 0;
 
 	if (provenance_is_name_recorded(prov_elt(prov)) ||
@@ -259,17 +480,8 @@ static inline int record_task_name(struct task_struct *task,
 			goto out;
 		}
 
-		// Memory allocation not allowed to sleep.
-		buffer = kcalloc(PATH_MAX, sizeof(char), GFP_ATOMIC);
-		if (!buffer) {
-			fput(exe_file); // Release the file.
-			rc = -ENOMEM;
-			goto out;
-		}
-		ptr = file_path(exe_file, buffer, PATH_MAX);
+		rc = record_exe_name(prov, exe_file);
 		fput(exe_file); // Release the file.
-		rc = record_node_name(prov, ptr, false);
-		kfree(buffer);
 	}
 out:
 	return rc;
@@ -279,6 +491,9 @@ out:
  * @brief Update @prov with process performance information associated with
  * @task.
  *
+ * When @task is the current task (as it is when the node is written, see
+ * prov_sample_task), no reference or lock is taken, so that it can be
+ * called with the node lock held.
  * @param task The task whose performance information to be obtained.
  * @param prov The provenance entry to be updated.
  *
@@ -299,7 +514,12 @@ static inline void update_task_perf(struct task_struct *task,
 	prov_elt(prov)->task_info.stime = div_u64(stime, NSEC_PER_USEC);
 
 	// memory
-	mm = get_task_mm(task);
+	// The mm of the current task cannot go away while it runs, it is read
+	// without a reference (no task_lock under the node lock).
+	if (task == current)
+		mm = (task->flags & PF_KTHREAD) ? NULL : task->mm;
+	else
+		mm = get_task_mm(task);
 	if (mm) {
 		// KB
 		prov_elt(prov)->task_info.vm =
@@ -310,7 +530,8 @@ static inline void update_task_perf(struct task_struct *task,
 			get_mm_hiwater_vm(mm) * PAGE_SIZE / KB;
 		prov_elt(prov)->task_info.hw_rss =
 			get_mm_hiwater_rss(mm) * PAGE_SIZE / KB;
-		mmput_async(mm);
+		if (task != current)
+			mmput_async(mm);
 	}
 	// IO
 #ifdef CONFIG_TASK_IO_ACCOUNTING
@@ -336,30 +557,56 @@ static inline void update_task_perf(struct task_struct *task,
  * performed.
  * The cred provenance entry is also updated with UID, GID, namespaces, secid,
  * and perform information.
+ * Those only change with the cred itself (setuid/setgid, exec, secctx
+ * transitions allocate a new cred), with the namespaces of the task (setns,
+ * unshare replace its nsproxy) or, for a cred shared by several processes
+ * (e.g. overridden creds), with the task. They are read again only when the
+ * task, its namespaces (see current_ns_recorded) or its real cred differ
+ * from the last update (see struct prov_cred_state).
  * @return The pointer to the cred provenance entry.
  *
  */
 static inline struct provenance *get_cred_provenance(void)
 {
 	// returns provenance pointer of current_cred().
-	struct provenance *prov = provenance_cred(current_cred());
+	const struct cred *cred = current_cred();
+	struct provenance *prov = provenance_cred(cred);
+	struct prov_cred_state *state = provenance_cred_state(cred);
+	uint64_t real_cred_id =
+		node_identifier(prov_elt(provenance_cred(current->real_cred))).id;
 	unsigned long irqflags;
+	uint32_t secid;
 
 	if (provenance_is_opaque(prov_elt(prov)))
 		return prov;
 	record_task_name(current, prov);
+	if (likely(READ_ONCE(state->real_cred_id) == real_cred_id
+		   && READ_ONCE(prov_elt(prov)->proc_info.tgid)
+		   == task_tgid_nr(current)
+		   && current_ns_recorded(prov)))
+		return prov;
+	security_task_getsecid(current, &secid);
 	spin_lock_irqsave_nested(prov_lock(prov),
 				 irqflags, PROVENANCE_LOCK_PROC);
-	prov_elt(prov)->proc_info.tgid = task_tgid_nr(current);
-	prov_elt(prov)->proc_info.utsns = current_utsns();
-	prov_elt(prov)->proc_info.ipcns = current_ipcns();
-	prov_elt(prov)->proc_info.mntns = current_mntns();
-	prov_elt(prov)->proc_info.pidns = current_pidns();
-	prov_elt(prov)->proc_info.netns = current_netns();
-	prov_elt(prov)->proc_info.cgroupns = current_cgroupns();
-	prov_elt(prov)->proc_info.uid = __kuid_val(current_uid());
-	prov_elt(prov)->proc_info.gid = __kgid_val(current_gid());
-	security_task_getsecid(current, &(prov_elt(prov)->proc_info.secid));
+	WRITE_ONCE(prov_elt(prov)->proc_info.tgid, task_tgid_nr(current));
+	update_target_attr(prov, prov_elt(prov)->proc_info.utsns,
+			   current_utsns());
+	update_target_attr(prov, prov_elt(prov)->proc_info.ipcns,
+			   current_ipcns());
+	update_target_attr(prov, prov_elt(prov)->proc_info.mntns,
+			   current_mntns());
+	update_target_attr(prov, prov_elt(prov)->proc_info.pidns,
+			   current_pidns());
+	update_target_attr(prov, prov_elt(prov)->proc_info.netns,
+			   current_netns());
+	update_target_attr(prov, prov_elt(prov)->proc_info.cgroupns,
+			   current_cgroupns());
+	update_target_attr(prov, prov_elt(prov)->proc_info.uid,
+			   __kuid_val(current_uid()));
+	update_target_attr(prov, prov_elt(prov)->proc_info.gid,
+			   __kgid_val(current_gid()));
+	update_target_attr(prov, prov_elt(prov)->proc_info.secid, secid);
+	WRITE_ONCE(state->real_cred_id, real_cred_id);
 	spin_unlock_irqrestore(prov_lock(prov), irqflags);
 	return prov;
 }
@@ -371,6 +618,8 @@ static inline struct provenance *get_cred_provenance(void)
  * We need to update pid and vpid here because when the task is first
  * initialized,
  * these information is not available.
+ * Hooks call this before taking any provenance lock, it is therefore where
+ * they are throttled under PROV_OVERFLOW_THROTTLE (see prov_throttle).
  * @return The provenance entry pointer.
  *
  * @todo We do not want to waste resource to attempt to update pid and vpid
@@ -381,9 +630,9 @@ static inline struct provenance *get_task_provenance(bool link)
 {
 	struct provenance *tprov = provenance_task(current);
 
+	prov_throttle();
 	prov_elt(tprov)->task_info.pid = task_pid_nr(current);
 	prov_elt(tprov)->task_info.vpid = task_pid_vnr(current);
-	update_task_perf(current, tprov);
 	if (!provenance_is_opaque(prov_elt(tprov)) && link)
 		record_kernel_link(prov_entry(tprov));
 	return tprov;
@@ -602,6 +851,196 @@ static __always_inline int record_arg(struct provenance *prov,
 	return rc;
 }
 
+/*
+ * Position in the arguments of an exec, read directly from the bprm pages
+ * (see record_packed_args).
+ */
+struct prov_arg_cursor {
+	struct linux_binprm *bprm;
+	struct page *page;
+	const char *kaddr;
+	unsigned long pos;
+};
+
+static inline void arg_cursor_unmap(struct prov_arg_cursor *cur)
+{
+	if (!cur->page)
+		return;
+	kunmap(cur->page);
+	put_page(cur->page);
+	cur->page = NULL;
+}
+
+/*!
+ * @brief Copy the string at the cursor and move the cursor past it.
+ *
+ * @param cur The cursor.
+ * @param dst The destination.
+ * @param cap The size of @dst (at least 1).
+ * @param truncated Set if the string did not fit in @dst.
+ * @return The number of bytes copied (the NUL terminator included) or -E2BIG
+ * if an argument page cannot be obtained.
+ *
+ */
+static inline long arg_cursor_string(struct prov_arg_cursor *cur,
+				     char *dst,
+				     size_t cap,
+				     bool *truncated)
+{
+	size_t copied = 0;
+	const char *src;
+	const char *nul = NULL;
+	size_t avail;
+	size_t n;
+
+	while (!nul && cur->pos < cur->bprm->exec) {
+		if (!cur->page) {
+			cur->page = get_arg_page(cur->bprm, cur->pos, 0);
+			if (!cur->page)
+				return -E2BIG;
+			cur->kaddr = kmap(cur->page);
+			flush_cache_page(cur->bprm->vma, cur->pos,
+					 page_to_pfn(cur->page));
+		}
+		src = cur->kaddr + cur->pos % PAGE_SIZE;
+		avail = min_t(unsigned long, PAGE_SIZE - cur->pos % PAGE_SIZE,
+			      cur->bprm->exec - cur->pos);
+		nul = memchr(src, '\0', avail);
+		n = nul ? nul - src + 1 : avail;
+		if (copied < cap)
+			memcpy(dst + copied, src, min_t(size_t, n, cap - copied));
+		copied += n;
+		cur->pos += n;
+		if (cur->pos % PAGE_SIZE == 0)
+			arg_cursor_unmap(cur);
+	}
+	if (copied < cap && (!copied || dst[copied - 1] != '\0'))
+		dst[copied++] = '\0';
+	if (copied > cap || (copied == cap && dst[cap - 1] != '\0')) {
+		*truncated = true;
+		dst[cap - 1] = '\0';
+		return cap;
+	}
+	return copied;
+}
+
+/*!
+ * @brief Record a packed ENT_ARGS entry and a RL_ARGS relation to @prov.
+ *
+ * The strings copied at the start of the value are moved after the offsets
+ * table.
+ * @param prov The provenance entry to which the arguments belong.
+ * @param aprov The ENT_ARGS entry holding @count strings in @used bytes.
+ * @param offsets The offsets of the strings from the start of the value.
+ * @param count The number of strings.
+ * @param used The number of bytes of the strings.
+ * @return 0 if no error occurred. Other error codes inherited from
+ * record_relation function.
+ *
+ */
+static inline int record_args_entry(struct provenance *prov,
+				    union long_prov_elt *aprov,
+				    uint16_t *offsets,
+				    uint32_t count,
+				    size_t used)
+{
+	size_t table = count * sizeof(uint16_t);
+	uint32_t i;
+
+	memmove(aprov->args_info.value + table, aprov->args_info.value, used);
+	for (i = 0; i < count; i++)
+		offsets[i] += table;
+	memcpy(aprov->args_info.value, offsets, table);
+	aprov->args_info.count = count;
+	aprov->args_info.length = table + used;
+	return record_relation(RL_ARGS, aprov, prov_entry(prov), NULL, 0);
+}
+
+/*!
+ * @brief Record the arguments and environment of an exec to @prov as packed
+ * ENT_ARGS entries (see struct args_struct).
+ *
+ * The strings are read directly from the bprm pages into the entry; a new
+ * entry is started when the next string (or its offset) does not fit. A
+ * string too long for an empty entry is truncated.
+ * @param prov The provenance entry to which the arguments belong.
+ * @param bprm The binary parameter structure.
+ * @return 0 if no error occurred; -ENOMEM if no long provenance entry can be
+ * obtained; -E2BIG if an argument page cannot be obtained. Other error codes
+ * inherited from record_relation function.
+ *
+ */
+static inline int record_packed_args(struct provenance *prov,
+				     struct linux_binprm *bprm)
+{
+	struct prov_arg_cursor cur = { .bprm = bprm, .pos = bprm->p };
+	uint32_t total = bprm->argc + bprm->envc;
+	uint16_t offsets[PROV_ARGS_MAX];
+	union long_prov_elt *aprov = NULL;
+	unsigned long start;
+	bool truncated;
+	uint32_t count = 0;
+	uint32_t i = 0;
+	size_t used = 0;
+	long cap;
+	long len;
+	int rc = 0;
+
+	while (i < total) {
+		if (!aprov) {
+			aprov = alloc_long_provenance(ENT_ARGS, 0);
+			if (!aprov) {
+				rc = -ENOMEM;
+				break;
+			}
+			aprov->args_info.argc = bprm->argc;
+			aprov->args_info.envc = bprm->envc;
+			aprov->args_info.first = i;
+		}
+		cap = (long)PROV_ARGS_SIZE - (long)used
+		      - (long)((count + 1) * sizeof(uint16_t));
+		if (count < PROV_ARGS_MAX && cap > 0) {
+			start = cur.pos;
+			truncated = false;
+			len = arg_cursor_string(&cur, aprov->args_info.value + used,
+						cap, &truncated);
+			if (len < 0) {
+				rc = len;
+				break;
+			}
+			// Only truncate a string that does not fit an empty entry.
+			if (!count || !truncated) {
+				if (truncated)
+					aprov->args_info.truncated = PROV_TRUNCATED;
+				offsets[count++] = used;
+				used += len;
+				i++;
+				continue;
+			}
+			arg_cursor_unmap(&cur);
+			cur.pos = start;
+		}
+		rc = record_args_entry(prov, aprov, offsets, count, used);
+		free_long_provenance(aprov);
+		aprov = NULL;
+		count = 0;
+		used = 0;
+		if (rc < 0)
+			break;
+	}
+	if (aprov) {
+		// Record what was read before an error too.
+		if (count) {
+			len = record_args_entry(prov, aprov, offsets, count, used);
+			if (!rc)
+				rc = len;
+		}
+		free_long_provenance(aprov);
+	}
+	arg_cursor_unmap(&cur);
+	return rc;
+}
+
 /*!
  * @brief Record all arguments to @prov.
  *
@@ -610,6 +1049,8 @@ static __always_inline int record_arg(struct provenance *prov,
  * We record both ENT_ARG and ENT_ENV types of arguments and relations RL_ARG
  * and RL_ENV between those arguments and @prov,
  * by calling record_arg function.
+ * If the "pack_args" policy is set (it is not by default), the arguments are
+ * recorded as packed entries instead (see record_packed_args).
  * @param prov The provenance entry pointer where arguments should be associated
  * with.
  * @param bprm The binary parameter structure.
@@ -630,6 +1071,8 @@ static inline int record_args(struct provenance *prov,
 
 	if (!provenance_is_tracked(prov_elt(prov)) && !prov_policy.prov_all)
 		return 0;
+	if (prov_policy.should_pack_args)
+		return record_packed_args(prov, bprm);
 	len = bprm->exec - bprm->p;
 	argv = kzalloc(len, GFP_KERNEL);
 	if (!argv)
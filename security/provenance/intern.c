@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2020 University of Bristol
+ *
+ * Author: Thomas Pasquier <thomas.pasquier@bristol.ac.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+
+/*!
+ * Interning of path nodes.
+ *
+ * The identifier of an ENT_PATH node is the hash of its path (see
+ * record_node_name), so the same path is always the same node. The table
+ * remembers the paths whose node has been written in the current epoch:
+ * a name whose path is interned is recorded with a RL_NAMED relation only,
+ * referencing the path node by its identifier.
+ * Paths are told apart by their hash and a second, independent hash of the
+ * path (see prov_intern_check), so that a djb2 collision is not mistaken
+ * for a path that has already been written.
+ * The table holds at most PROV_INTERN_MAX paths, the oldest path is evicted
+ * to make room, and it is shrunk under memory pressure. An evicted path is
+ * written again the next time it is used.
+ * Delivery is per channel, so a path is only interned if its node reached
+ * every channel. The table is invalidated (see prov_intern_flush) when a
+ * path node may have been lost on a channel, or when a channel is created:
+ * every path is then written again the next time it is used.
+ */
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "provenance.h"
+#include "provenance_intern.h"
+
+struct prov_intern {
+	struct hlist_node hlist;
+	struct list_head lru;
+	struct rcu_head rcu;
+	uint64_t hash;
+	// Second hash of the path, see prov_intern_check.
+	uint32_t check;
+	// Epoch in which the path node was last written.
+	uint32_t epoch;
+	// Generation in which the path node was last written.
+	int gen;
+};
+
+static DEFINE_HASHTABLE(intern_table, PROV_INTERN_HASH_BITS);
+// Interned paths, oldest first.
+static LIST_HEAD(intern_lru);
+// Serialises updates of the table.
+static DEFINE_SPINLOCK(intern_lock);
+static unsigned long intern_count;
+// Bumped to invalidate every interned path, see prov_intern_flush.
+static atomic_t intern_gen = ATOMIC_INIT(0);
+
+static struct prov_intern *intern_find(uint64_t hash, uint32_t check)
+{
+	struct prov_intern *entry;
+
+	hash_for_each_possible_rcu(intern_table, entry, hlist, hash) {
+		if (entry->hash == hash && entry->check == check)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Called with intern_lock held. */
+static void intern_evict(struct prov_intern *entry)
+{
+	hash_del_rcu(&entry->hlist);
+	list_del(&entry->lru);
+	intern_count--;
+	kfree_rcu(entry, rcu);
+}
+
+/*!
+ * @brief Check whether the node of a path has been written in this epoch.
+ *
+ * @param hash The hash of the path (i.e., the identifier of its node).
+ * @param check The second hash of the path (see prov_intern_check).
+ * @return true if the path node has been written in the current epoch.
+ *
+ */
+bool prov_path_interned(uint64_t hash, uint32_t check)
+{
+	struct prov_intern *entry;
+	bool rc = false;
+
+	rcu_read_lock();
+	entry = intern_find(hash, check);
+	if (entry)
+		rc = READ_ONCE(entry->epoch) == epoch
+		     && READ_ONCE(entry->gen) == atomic_read(&intern_gen);
+	rcu_read_unlock();
+	return rc;
+}
+
+/*!
+ * @brief Generation of the table, to be read before writing a path node.
+ */
+int prov_intern_generation(void)
+{
+	return atomic_read(&intern_gen);
+}
+
+/*!
+ * @brief Invalidate every interned path.
+ *
+ * Called when a path node may not have reached a channel (i.e., it was
+ * dropped or a cursor was lapped) and when a channel is created. Safe to
+ * call from any context.
+ */
+void prov_intern_flush(void)
+{
+	atomic_inc(&intern_gen);
+}
+
+/*!
+ * @brief Remember that the node of a path has been written in this epoch.
+ *
+ * If the table is full, its oldest path is evicted. Failing to allocate
+ * is not an error, the path will simply be written again.
+ * The path is not interned if the table was invalidated since its node was
+ * written, as the node may be the one that was lost.
+ * @param hash The hash of the path (i.e., the identifier of its node).
+ * @param check The second hash of the path (see prov_intern_check).
+ * @param gen The generation read before the node was written (see
+ * prov_intern_generation).
+ *
+ */
+void prov_path_intern(uint64_t hash, uint32_t check, int gen)
+{
+	struct prov_intern *entry;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&intern_lock, irqflags);
+	if (gen != atomic_read(&intern_gen))
+		goto out;
+	entry = intern_find(hash, check);
+	if (entry) {
+		WRITE_ONCE(entry->epoch, epoch);
+		WRITE_ONCE(entry->gen, gen);
+		list_move_tail(&entry->lru, &intern_lru);
+		goto out;
+	}
+	if (intern_count >= PROV_INTERN_MAX)
+		intern_evict(list_first_entry(&intern_lru,
+					      struct prov_intern, lru));
+	entry = kmalloc(sizeof(struct prov_intern), GFP_ATOMIC);
+	if (!entry)
+		goto out;
+	entry->hash = hash;
+	entry->check = check;
+	entry->epoch = epoch;
+	entry->gen = gen;
+	list_add_tail(&entry->lru, &intern_lru);
+	hash_add_rcu(intern_table, &entry->hlist, hash);
+	intern_count++;
+out:
+	spin_unlock_irqrestore(&intern_lock, irqflags);
+}
+
+static unsigned long intern_shrink_count(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	unsigned long count = READ_ONCE(intern_count);
+
+	return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long intern_shrink_scan(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&intern_lock, irqflags);
+	while (freed < sc->nr_to_scan && !list_empty(&intern_lru)) {
+		intern_evict(list_first_entry(&intern_lru,
+					      struct prov_intern, lru));
+		freed++;
+	}
+	spin_unlock_irqrestore(&intern_lock, irqflags);
+	return freed;
+}
+
+static struct shrinker intern_shrinker = {
+	.count_objects = intern_shrink_count,
+	.scan_objects = intern_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static __init int prov_intern_init(void)
+{
+	int rc = register_shrinker(&intern_shrinker);
+
+	if (rc)
+		pr_err("Provenance: failed to register path intern shrinker.");
+	return rc;
+}
+fs_initcall(prov_intern_init);
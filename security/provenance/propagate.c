@@ -16,7 +16,9 @@
 #include "provenance.h"
 #include "provenance_query.h"
 
-static int flow(prov_entry_t *from, prov_entry_t *edge, prov_entry_t *to)
+int prov_propagate_flow(prov_entry_t *from,
+			prov_entry_t *edge,
+			prov_entry_t *to)
 {
 	if (provenance_does_propagate(from) && provenance_is_tracked(from))
 		// can propagate over edge?
@@ -30,7 +32,7 @@ static int flow(prov_entry_t *from, prov_entry_t *edge, prov_entry_t *to)
 }
 
 static struct provenance_query_hooks hooks = {
-	QUERY_HOOK_INIT(flow, flow),
+	QUERY_HOOK_INIT(flow, prov_propagate_flow),
 };
 
 /*!
@@ -13,17 +13,225 @@
  * or (at your option) any later version.
  */
 #include <linux/rculist.h>
+#include <linux/mutex.h>
+#include <linux/jump_label.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
 #include <uapi/asm-generic/errno-base.h>
 #include <linux/socket.h>
 #include <linux/utsname.h>
 
 #include "provenance_query.h"
+#include "memcpy_ss.h"
+
+DEFINE_STATIC_KEY_FALSE(prov_query_key);
+DEFINE_STATIC_KEY_FALSE(prov_query_list_key);
+DEFINE_STATIC_KEY_FALSE(prov_query_observe_key);
+// Serialises hook registration.
+static DEFINE_MUTEX(query_hooks_lock);
+
+struct prov_observe_ring {
+	struct provenance_flow *flows;
+	unsigned int head;
+	unsigned int tail;
+	// Deferred kick, safe from any context the hooks may run in.
+	struct irq_work kick;
+	struct work_struct work;
+	int cpu;
+	// Flows lost because the ring was full, see provenance_observe_dropped.
+	uint64_t dropped;
+};
+
+static DEFINE_PER_CPU(struct prov_observe_ring, prov_observe_rings);
+// Observer rings are allocated, never freed.
+static bool observe_ready;
+
+static inline bool is_propagate_hook(struct provenance_query_hooks *hook)
+{
+	return hook->flow == prov_propagate_flow && !hook->alloc && !hook->free;
+}
+
+static inline bool is_sync_hook(struct provenance_query_hooks *hook)
+{
+	return hook->flow || hook->alloc || hook->free;
+}
+
+/*!
+ * @brief Select how hooks are called after the list of hooks changed.
+ *
+ * Hooks that only observe are not called on the synchronous path.
+ * Called with query_hooks_lock held.
+ */
+static void update_query_keys(void)
+{
+	struct provenance_query_hooks *hook;
+	bool observe = false;
+	bool list = false;
+	int nr = 0;
+
+	list_for_each_entry(hook, &provenance_query_hooks, list) {
+		if (hook->observe)
+			observe = true;
+		if (!is_sync_hook(hook))
+			continue;
+		if (!is_propagate_hook(hook))
+			list = true;
+		nr++;
+	}
+	// The list key is enabled before (and disabled after) the hook key.
+	if (list)
+		static_branch_enable(&prov_query_list_key);
+	if (nr)
+		static_branch_enable(&prov_query_key);
+	else
+		static_branch_disable(&prov_query_key);
+	if (!list)
+		static_branch_disable(&prov_query_list_key);
+	if (observe)
+		static_branch_enable(&prov_query_observe_key);
+	else
+		static_branch_disable(&prov_query_observe_key);
+}
+
+/*!
+ * @brief Queue a flow for the observers.
+ *
+ * Called through call_query_hooks when at least one observer is registered.
+ * The flow is dropped if the buffer of the current CPU is full.
+ * @param from The source node.
+ * @param edge The relation.
+ * @param to The destination node.
+ *
+ */
+void prov_observe(prov_entry_t *from, prov_entry_t *edge, prov_entry_t *to)
+{
+	struct prov_observe_ring *ring;
+	struct provenance_flow *flow;
+	unsigned long irqflags;
+	unsigned int head;
+
+	local_irq_save(irqflags);
+	ring = this_cpu_ptr(&prov_observe_rings);
+	head = ring->head;
+	// Pairs with release in prov_observe_deliver.
+	if (head - smp_load_acquire(&ring->tail) >= PROV_OBSERVE_RING) {
+		WRITE_ONCE(ring->dropped, ring->dropped + 1);
+		goto out;
+	}
+	flow = &ring->flows[head & (PROV_OBSERVE_RING - 1)];
+	__memcpy_ss(&flow->from, sizeof(struct node_struct),
+		    from, sizeof(struct node_struct));
+	__memcpy_ss(&flow->edge, sizeof(union prov_elt),
+		    edge, sizeof(union prov_elt));
+	__memcpy_ss(&flow->to, sizeof(struct node_struct),
+		    to, sizeof(struct node_struct));
+	smp_store_release(&ring->head, head + 1);
+	irq_work_queue(&ring->kick);
+out:
+	local_irq_restore(irqflags);
+}
+
+static void prov_observe_kick(struct irq_work *kick)
+{
+	struct prov_observe_ring *ring =
+		container_of(kick, struct prov_observe_ring, kick);
+
+	queue_work_on(ring->cpu, system_wq, &ring->work);
+}
+
+/*!
+ * @brief Hand the flows buffered on a CPU to the observers, in batches of
+ * contiguous entries.
+ */
+static void prov_observe_deliver(struct work_struct *work)
+{
+	struct prov_observe_ring *ring =
+		container_of(work, struct prov_observe_ring, work);
+	struct provenance_query_hooks *hook;
+	unsigned int head, tail, n;
+
+	for (;;) {
+		tail = ring->tail;
+		// Pairs with release in prov_observe.
+		head = smp_load_acquire(&ring->head);
+		if (head == tail)
+			break;
+		n = min(head - tail,
+			PROV_OBSERVE_RING - (tail & (PROV_OBSERVE_RING - 1)));
+		rcu_read_lock();
+		list_for_each_entry_rcu(hook, &provenance_query_hooks, list) {
+			if (hook->observe)
+				hook->observe(&ring->flows[tail & (PROV_OBSERVE_RING - 1)],
+					      n);
+		}
+		rcu_read_unlock();
+		smp_store_release(&ring->tail, tail + n);
+		cond_resched();
+	}
+}
+
+/*!
+ * @brief Number of flows dropped before reaching the observers.
+ *
+ * Observers can compare successive values to detect that they missed flows.
+ * The count is also readable from the "observe" securityfs file.
+ * @return The number of flows dropped since boot, on every CPU.
+ *
+ */
+uint64_t provenance_observe_dropped(void)
+{
+	uint64_t dropped = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		dropped += READ_ONCE(per_cpu(prov_observe_rings, cpu).dropped);
+	return dropped;
+}
+EXPORT_SYMBOL_GPL(provenance_observe_dropped);
+
+/*!
+ * @brief Allocate the observer rings, the first time an observer registers.
+ *
+ * Called with query_hooks_lock held.
+ * @return 0 or -ENOMEM.
+ *
+ */
+static int observe_init(void)
+{
+	struct prov_observe_ring *ring;
+	int cpu;
+
+	if (observe_ready)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_observe_rings, cpu);
+		ring->cpu = cpu;
+		init_irq_work(&ring->kick, prov_observe_kick);
+		INIT_WORK(&ring->work, prov_observe_deliver);
+		ring->flows = kvzalloc_node(array_size(PROV_OBSERVE_RING,
+						       sizeof(struct provenance_flow)),
+					    GFP_KERNEL, cpu_to_node(cpu));
+		if (!ring->flows)
+			goto out_free;
+	}
+	observe_ready = true;
+	return 0;
+out_free:
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_observe_rings, cpu);
+		kvfree(ring->flows);
+		ring->flows = NULL;
+	}
+	return -ENOMEM;
+}
 
 /*!
  * @brief Register provenance query hooks.
  *
  * @param hook The provenance_query_hooks pointer.
- * @return 0 if no error occurred; -ENOMEM if hook is NULL (does not exist yet).
+ * @return 0 if no error occurred; -ENOMEM if hook is NULL (does not exist yet)
+ * or the observer buffers could not be allocated.
  *
  */
 int register_provenance_query_hooks(struct provenance_query_hooks *hook)
@@ -31,7 +239,14 @@ int register_provenance_query_hooks(struct provenance_query_hooks *hook)
 	if (!hook)
 		return -ENOMEM;
 	pr_info("Provenance: registering policy hook...\n");
+	mutex_lock(&query_hooks_lock);
+	if (hook->observe && observe_init()) {
+		mutex_unlock(&query_hooks_lock);
+		return -ENOMEM;
+	}
 	list_add_tail_rcu(&(hook->list), &provenance_query_hooks);
+	update_query_keys();
+	mutex_unlock(&query_hooks_lock);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(register_provenance_query_hooks);
@@ -39,13 +254,19 @@ EXPORT_SYMBOL_GPL(register_provenance_query_hooks);
 /*!
  * @brief Unregister provenance query hooks.
  *
+ * When this function returns, the hooks (observers included) are no longer
+ * called and the module that registered them can be unloaded.
  * @param hook The provenance_query_hooks pointer.
  * @return 0 if no error occurred.
  *
  */
 int unregister_provenance_query_hooks(struct provenance_query_hooks *hook)
 {
+	mutex_lock(&query_hooks_lock);
 	list_del_rcu(&(hook->list));
+	update_query_keys();
+	mutex_unlock(&query_hooks_lock);
+	synchronize_rcu();
 	return 0;
 }
 EXPORT_SYMBOL_GPL(unregister_provenance_query_hooks);
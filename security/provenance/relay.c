@@ -15,16 +15,27 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/debugfs.h>
-#include <linux/async.h>
-#include <linux/delay.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/nsproxy.h>
+#include <linux/utsname.h>
+#include <linux/ipc_namespace.h>
+#include <linux/pid_namespace.h>
+#include <linux/cgroup.h>
+#include <net/net_namespace.h>
 
 #include "provenance.h"
 #include "provenance_relay.h"
 #include "provenance_machine.h"
+#include "provenance_intern.h"
 #include "memcpy_ss.h"
 
 #define PROV_BASE_NAME          "provenance"
-#define LONG_PROV_BASE_NAME     "long_provenance"
 
 /*!
  * @brief A list of relay channel data structure.
@@ -39,288 +50,2548 @@ struct relay_list {
 	struct rchan *prov;
 	// Relay buffer for long provenance entries.
 	struct rchan *long_prov;
+	// Long entries are written in variable-length form.
+	bool varlen;
+	// Regular entries are written as a compact stream.
+	bool compact;
+	// Per-CPU compact stream state (i.e., previous relation).
+	struct prov_compact_state __percpu *compact_state;
+	// Entries dropped because the relay buffer was full.
+	atomic64_t lost;
+	atomic64_t long_lost;
+	// Bit of the channel filter, 0 if the channel gets every entry.
+	uint64_t bit;
 };
 static LIST_HEAD(relay_list);
 
 /*!
- * @brief Add an element to the tail end of the relay list, which is identified
- * by the "extern struct list_head relay_list" above.
- * @param name Member of the element in the relay list
- * @param prov Member of the element in the relay list. This is a relay channel
- * pointer.
- * @param long_prov Member of the element in the relay list. This is a relay
- * channel pointer.
+ * @brief Geometry of the relay buffer of a channel (per CPU).
+ */
+struct prov_relay_size {
+	size_t subbuf_size;
+	size_t n_subbufs;
+};
+
+/* Relation categories, indexed by relation_category. */
+#define PROV_RELATION_CATEGORIES 6
+
+/*!
+ * @brief Capture filter of a channel, see parse_channel_opts.
+ *
+ * Filters are evaluated once per entry when it is recorded (see
+ * channel_mask), each filtered channel owns a bit of the resulting mask.
+ */
+struct prov_channel_filter {
+	struct list_head list;
+	uint64_t bit;
+	// Types are matched when at least one mask is set.
+	bool has_type;
+	uint64_t node_mask;
+	uint64_t relation_mask[PROV_RELATION_CATEGORIES];
+	// Namespaces of the recording task, IGNORE_NS matches any.
+	bool has_ns;
+	uint32_t utsns;
+	uint32_t ipcns;
+	uint32_t pidns;
+	uint32_t netns;
+	uint32_t cgroupns;
+};
+static LIST_HEAD(filter_list);
+// Bits owned by filters, protected by channel_lock.
+static uint64_t filter_bits;
+#define PROV_ALL_CHANNELS (~0ULL)
+
+/*!
+ * @brief Options of a channel, fixed at creation.
+ *
+ * Boot parameters set the options of the base channel and the defaults of
+ * channels created through securityfs.
+ * A zero relay size stands for the default size.
+ */
+struct prov_channel_opts {
+	bool varlen;
+	bool compact;
+	// Read the per-CPU shared logs through cursors, see prov_create_channel.
+	bool shared;
+	// "shared" was given explicitly.
+	bool shared_set;
+	struct prov_relay_size size;
+	struct prov_relay_size long_size;
+	struct prov_channel_filter filter;
+};
+
+static __always_inline unsigned int relation_category(uint64_t type)
+{
+	return __ffs64((type >> 50) & 0x3F);
+}
+
+static __always_inline bool filter_match_type(const struct prov_channel_filter *f,
+					      uint64_t type)
+{
+	if (!f->has_type)
+		return true;
+	if (!prov_type_is_relation(type))
+		return HIT_FILTER(SUBTYPE(f->node_mask), SUBTYPE(type));
+	if (!SUBTYPE(type) || !((type >> 50) & 0x3F))
+		return false;
+	return HIT_FILTER(SUBTYPE(f->relation_mask[relation_category(type)]),
+			  SUBTYPE(type));
+}
+
+#define ns_miss(f, field, ns)	\
+	((f)->field != IGNORE_NS && (f)->field != (ns)->ns.inum)
+
+/*!
+ * @brief Match the namespaces of the current task.
+ *
+ * Only the current task changes its own nsproxy, so it can be read without
+ * task_lock. Entries recorded outside task context (e.g., softirq) have no
+ * meaningful task and never match.
+ */
+static __always_inline bool filter_match_ns(const struct prov_channel_filter *f)
+{
+	struct nsproxy *nsp;
+
+	if (!f->has_ns)
+		return true;
+	if (!in_task())
+		return false;
+	nsp = current->nsproxy;
+	if (!nsp)
+		return false;
+	if (ns_miss(f, utsns, nsp->uts_ns) || ns_miss(f, ipcns, nsp->ipc_ns)
+	    || ns_miss(f, netns, nsp->net_ns)
+	    || ns_miss(f, cgroupns, nsp->cgroup_ns)
+	    || ns_miss(f, pidns, task_active_pid_ns(current)))
+		return false;
+	return true;
+}
+
+/*!
+ * @brief Compute the channels an entry is delivered to.
+ *
+ * Called when the entry is recorded (i.e., in the context of the hook) so
+ * that namespace filters see the task at the origin of the entry.
+ * @param msg The entry.
+ * @return A mask with the bit of every filter the entry does not pass
+ * cleared.
+ *
+ */
+static __always_inline uint64_t channel_mask(const void *msg)
+{
+	uint64_t type = prov_type((const union prov_elt *)msg);
+	struct prov_channel_filter *f;
+	uint64_t mask = PROV_ALL_CHANNELS;
+
+	if (likely(list_empty(&filter_list)))
+		return mask;
+	rcu_read_lock();
+	list_for_each_entry_rcu(f, &filter_list, list) {
+		if (!filter_match_type(f, type) || !filter_match_ns(f))
+			mask &= ~f->bit;
+	}
+	rcu_read_unlock();
+	return mask;
+}
+
+/*!
+ * @brief Whether no channel filter drops an entry recorded by the current
+ * task (see record_node_name).
+ */
+bool prov_channels_accept(const void *msg)
+{
+	return channel_mask(msg) == PROV_ALL_CHANNELS;
+}
+
+/* Whether a channel with filter bit "bit" gets an entry of mask "chans". */
+#define channel_gets(bit, chans)	(!(bit) || ((chans) & (bit)))
+
+static bool prov_long_varlen;
+static bool prov_compact;
+static struct prov_relay_size prov_relay_size = {
+	.subbuf_size = PROV_RELAY_BUFF_SIZE,
+	.n_subbufs = PROV_NB_SUBBUF,
+};
+static struct prov_relay_size prov_long_relay_size = {
+	.subbuf_size = PROV_RELAY_BUFF_SIZE,
+	.n_subbufs = PROV_NB_SUBBUF,
+};
+
+/*!
+ * @brief Parse a relay size of the form "<sub-buffer size>[,<count>]".
+ *
+ * The sub-buffer size accepts the K, M and G suffixes.
+ * @return 0 or -EINVAL.
+ *
+ */
+static int parse_relay_size(char *str, struct prov_relay_size *size)
+{
+	unsigned long n_subbufs;
+	char *end;
+
+	size->subbuf_size = memparse(str, &end);
+	if (end == str)
+		return -EINVAL;
+	if (*end == ',') {
+		if (kstrtoul(end + 1, 0, &n_subbufs))
+			return -EINVAL;
+		size->n_subbufs = n_subbufs;
+	} else if (*end)
+		return -EINVAL;
+	return 0;
+}
+
+/*!
+ * @brief Parse "provenance_relay=<sub-buffer size>[,<count>]" boot parameter.
+ *
+ * Sets the per-CPU relay buffer of the base channel for regular entries,
+ * and the default for channels created through securityfs.
+ */
+static int __init prov_relay_setup(char *str)
+{
+	return parse_relay_size(str, &prov_relay_size) == 0;
+}
+__setup("provenance_relay=", prov_relay_setup);
+
+/*!
+ * @brief Same as "provenance_relay=" for long provenance entries.
+ */
+static int __init prov_long_relay_setup(char *str)
+{
+	return parse_relay_size(str, &prov_long_relay_size) == 0;
+}
+__setup("provenance_long_relay=", prov_long_relay_setup);
+
+/*!
+ * @brief Parse "provenance_varlen=<0|1>" boot parameter.
+ *
+ * When set, long provenance entries are written to channels created from
+ * then on in the variable-length form described in
+ * include/uapi/linux/provenance.h (see struct prov_long_header), instead of
+ * sizeof(union long_prov_elt) bytes.
+ */
+static int __init prov_varlen_setup(char *str)
+{
+	return kstrtobool(str, &prov_long_varlen) == 0;
+}
+__setup("provenance_varlen=", prov_varlen_setup);
+
+/*!
+ * @brief Parse "provenance_compact=<0|1>" boot parameter.
+ *
+ * When set, regular provenance entries are written as a compact
+ * delta-encoded stream (see struct prov_compact_header in
+ * include/uapi/linux/provenance.h).
+ */
+static int __init prov_compact_setup(char *str)
+{
+	return kstrtobool(str, &prov_compact) == 0;
+}
+__setup("provenance_compact=", prov_compact_setup);
+
+struct prov_overflow_policy prov_overflow = {
+	.mode = PROV_OVERFLOW_DROP,
+	.wait_ms = PROV_OVERFLOW_WAIT_MS,
+};
+
+/*!
+ * @brief Parse "provenance_overflow=<drop|throttle>[,<ms>]" boot parameter.
+ *
+ * Sets the policy applied when relay buffers are full (see struct
+ * prov_overflow_policy), it can be changed at runtime through securityfs.
+ */
+static int __init prov_overflow_setup(char *str)
+{
+	char *ms = strchr(str, ',');
+
+	if (ms)
+		*ms++ = '\0';
+	if (strcmp(str, "throttle") == 0)
+		prov_overflow.mode = PROV_OVERFLOW_THROTTLE;
+	else if (strcmp(str, "drop") == 0)
+		prov_overflow.mode = PROV_OVERFLOW_DROP;
+	else
+		return 0;
+	if (ms && kstrtouint(ms, 0, &prov_overflow.wait_ms))
+		return 0;
+	if (prov_overflow.wait_ms > PROV_OVERFLOW_MAX_WAIT_MS)
+		prov_overflow.wait_ms = PROV_OVERFLOW_MAX_WAIT_MS;
+	return 1;
+}
+__setup("provenance_overflow=", prov_overflow_setup);
+
+/*!
+ * @brief Per-CPU count of dropped entries, see prov_drop_info.
+ *
+ * Slots are indexed by drop_slot, "prov_drop_type" records the type each
+ * slot was last used for (all types sharing a slot are equal).
+ */
+struct prov_drops {
+	uint64_t count[PROV_DROP_SLOTS];
+};
+static DEFINE_PER_CPU(struct prov_drops, prov_drops);
+static uint64_t prov_drop_type[PROV_DROP_SLOTS];
+
+/*!
+ * @brief Map a type to a drop counter.
+ *
+ * Node types and relation subtypes are single bits, so a type is identified
+ * by its relation category (0 for nodes) and the position of its subtype bit.
+ */
+static __always_inline unsigned int drop_slot(uint64_t type)
+{
+	uint64_t category = (type >> 50) & 0x3F;
+	unsigned int slot = 0;
+
+	if (SUBTYPE(type))
+		slot = __ffs64(SUBTYPE(type)) + 1;
+	if (prov_type_is_relation(type) && category)
+		slot += (__ffs64(category) + 1) * PROV_DROP_SUBTYPES;
+	return slot;
+}
+
+/*!
+ * @brief Count a dropped entry.
+ *
+ * A dropped path node invalidates interned paths, so that relations do not
+ * reference a path node a channel never received (see intern.c).
+ */
+static __always_inline void count_drop(const void *msg)
+{
+	uint64_t type = prov_type((const union prov_elt *)msg);
+	unsigned int slot = drop_slot(type);
+
+	WRITE_ONCE(prov_drop_type[slot], type);
+	this_cpu_inc(prov_drops.count[slot]);
+	if (type == ENT_PATH)
+		prov_intern_flush();
+}
+
+/*!
+ * @brief Fill dropped entry counts, one entry per type with drops.
+ * @param info Array to be filled.
+ * @param nr Number of entries in the array.
+ * @return Number of entries filled.
+ *
+ */
+size_t prov_drop_info(struct prov_drop_info *info, size_t nr)
+{
+	unsigned int slot;
+	uint64_t count;
+	size_t i = 0;
+	int cpu;
+
+	for (slot = 0; slot < PROV_DROP_SLOTS && i < nr; slot++) {
+		count = 0;
+		for_each_possible_cpu(cpu)
+			count += READ_ONCE(per_cpu(prov_drops, cpu).count[slot]);
+		if (!count)
+			continue;
+		info[i].type = READ_ONCE(prov_drop_type[slot]);
+		info[i].count = count;
+		i++;
+	}
+	return i;
+}
+
+static bool relay_write_all(void *msg, size_t size, uint64_t chans);
+static bool long_relay_write_all(void *msg, size_t size, uint64_t chans);
+
+/*!
+ * @brief Flush every relay buffer element in the relay list.
+ */
+void prov_flush(void)
+{
+	struct relay_list *tmp;
+
+	if (unlikely(!relay_ready))
+		return;
+
+	prov_ring_flush();
+	list_for_each_entry(tmp, &relay_list, list) {
+		relay_flush(tmp->prov);
+		relay_flush(tmp->long_prov);
+	}
+}
+
+/* Global variables: variable declarations in provenance.h */
+static struct rchan *prov_chan;
+static struct rchan *long_prov_chan;
+atomic64_t prov_relation_id = ATOMIC64_INIT(0);
+atomic64_t prov_node_id = ATOMIC64_INIT(0);
+DEFINE_PER_CPU(struct prov_id_block, prov_relation_ids);
+DEFINE_PER_CPU(struct prov_id_block, prov_node_ids);
+
+static void prov_relay_consumed(void);
+
+static ssize_t relay_file_read_handler(struct file *filp, char __user *buffer,
+				       size_t count, loff_t *ppos)
+{
+	ssize_t rc = relay_file_operations.read(filp, buffer, count, ppos);
+
+	if (rc > 0)
+		prov_relay_consumed();
+	return rc;
+}
+
+static ssize_t relay_file_splice_read_handler(struct file *in, loff_t *ppos,
+					      struct pipe_inode_info *pipe,
+					      size_t len, unsigned int flags)
+{
+	ssize_t rc = relay_file_operations.splice_read(in, ppos, pipe, len,
+						       flags);
+
+	if (rc > 0)
+		prov_relay_consumed();
+	return rc;
+}
+
+/*
+ * Relay file operations, with a notification when sub-buffers are consumed
+ * (relay has no callback for it). Set up in relay_prov_init.
+ */
+static struct file_operations prov_relay_file_operations;
+
+/*!
+ * @brief Callback function of function "create_buf_file". This callback
+ * function creates relay file in "debugfs".
+ */
+static struct dentry *create_buf_file_handler(const char *filename,
+					      struct dentry *parent,
+					      umode_t mode,
+					      struct rchan_buf *buf,
+					      int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &prov_relay_file_operations);
+}
+
+/*!
+ * @brief Callback function of function "remove_buf_file". This callback
+ * function removes the relay file from "debugfs".
+ */
+static int remove_buf_file_handler(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+
+static void compact_reset(struct prov_compact_state *st)
+{
+	memset(st, 0, sizeof(struct prov_compact_state));
+	st->boot_id = prov_boot_id;
+	st->machine_id = prov_machine_id;
+}
+
+static void compact_header(struct prov_compact_header *hdr,
+			   const struct prov_compact_state *st)
+{
+	hdr->magic = PROV_COMPACT_MAGIC;
+	hdr->version = PROV_COMPACT_VERSION;
+	hdr->boot_id = st->boot_id;
+	hdr->machine_id = st->machine_id;
+}
+
+/*!
+ * @brief Callback function of function "subbuf_start".
+ *
+ * Behaves as the default relay callback (i.e., no overwrite). In addition,
+ * every sub-buffer of a compact channel starts with a stream header and the
+ * delta encoding state is reset, so that each sub-buffer can be decoded on
+ * its own.
+ * Only the regular relay channel of a compact channel has private data.
+ */
+static int subbuf_start_handler(struct rchan_buf *buf,
+				void *subbuf,
+				void *prev_subbuf,
+				size_t prev_padding)
+{
+	struct relay_list *elt = buf->chan->private_data;
+	struct prov_compact_state *st;
+
+	if (!elt || !elt->compact)
+		return !relay_buf_full(buf);
+	st = per_cpu_ptr(elt->compact_state, buf->cpu);
+	compact_reset(st);
+	if (relay_buf_full(buf))
+		return 0;
+	compact_header(subbuf, st);
+	subbuf_start_reserve(buf, sizeof(struct prov_compact_header));
+	return 1;
+}
+
+/* Relay interface callback functions */
+static struct rchan_callbacks relay_callbacks = {
+	.subbuf_start = subbuf_start_handler,
+	.create_buf_file = create_buf_file_handler,
+	.remove_buf_file = remove_buf_file_handler,
+};
+
+static uint8_t *compact_put_id(uint8_t *p,
+			       uint16_t *fields,
+			       uint16_t raw_bit,
+			       uint16_t type_bit,
+			       uint16_t ver_bit,
+			       const struct prov_compact_state *st,
+			       const union prov_identifier *id,
+			       const union prov_identifier *prev)
+{
+	if (id->node_id.type == ENT_PACKET
+	    || id->node_id.boot_id != st->boot_id
+	    || id->node_id.machine_id != st->machine_id) {
+		*fields |= raw_bit;
+		memcpy(p, id, PROV_IDENTIFIER_BUFFER_LENGTH);
+		return p + PROV_IDENTIFIER_BUFFER_LENGTH;
+	}
+	if (id->node_id.type != prev->node_id.type) {
+		*fields |= type_bit;
+		memcpy(p, &id->node_id.type, sizeof(uint64_t));
+		p += sizeof(uint64_t);
+	}
+	p = prov_put_varint(p, prov_zigzag(id->node_id.id - prev->node_id.id));
+	if (id->node_id.version != prev->node_id.version) {
+		*fields |= ver_bit;
+		p = prov_put_varint(p, id->node_id.version);
+	}
+	return p;
+}
+
+/*!
+ * @brief Encode an entry of a compact stream, see prov_compact_decode.
+ *
+ * Relations are delta-encoded against the previous relation of the stream,
+ * nodes (and relations that would not be smaller) are written raw.
+ * The state is not modified, see compact_commit.
+ * @param dst Destination, at least PROV_COMPACT_MAX bytes.
+ * @param st State of the stream.
+ * @param msg The entry.
+ * @return Length of the encoded entry.
+ *
+ */
+static size_t compact_encode(uint8_t *dst,
+			     const struct prov_compact_state *st,
+			     const union prov_elt *msg)
+{
+	const struct relation_struct *rel = &msg->relation_info;
+	const struct relation_struct *prev = &st->prev.relation_info;
+	struct prov_compact_record rec = { .len = 0, .fields = 0 };
+	uint8_t *p = dst + sizeof(struct prov_compact_record);
+
+	if (!prov_is_relation(msg))
+		goto raw;
+	if (rel->identifier.relation_id.type != prev->identifier.relation_id.type) {
+		rec.fields |= PROV_C_TYPE;
+		memcpy(p, &rel->identifier.relation_id.type, sizeof(uint64_t));
+		p += sizeof(uint64_t);
+	}
+	if (rel->identifier.relation_id.boot_id != st->boot_id
+	    || rel->identifier.relation_id.machine_id != st->machine_id) {
+		rec.fields |= PROV_C_RID;
+		memcpy(p, &rel->identifier.relation_id.boot_id, sizeof(uint32_t));
+		memcpy(p + sizeof(uint32_t),
+		       &rel->identifier.relation_id.machine_id,
+		       sizeof(uint32_t));
+		p += 2 * sizeof(uint32_t);
+	}
+	p = prov_put_varint(p, prov_zigzag(rel->identifier.relation_id.id
+					   - prev->identifier.relation_id.id));
+	if (rel->epoch != prev->epoch) {
+		rec.fields |= PROV_C_EPOCH;
+		p = prov_put_varint(p, rel->epoch);
+	}
+	if (rel->nepoch != prev->nepoch
+	    || rel->internal_flag != prev->internal_flag
+	    || rel->taint != prev->taint
+	    || rel->allowed != prev->allowed) {
+		rec.fields |= PROV_C_MISC;
+		p = prov_put_varint(p, rel->nepoch);
+		p = prov_put_varint(p, rel->internal_flag);
+		p = prov_put_varint(p, rel->taint);
+		p = prov_put_varint(p, rel->allowed);
+	}
+	p = prov_put_varint(p, prov_zigzag(rel->jiffies - prev->jiffies));
+	p = prov_put_varint(p, prov_zigzag(rel->ts - prev->ts));
+	p = prov_put_varint(p, prov_zigzag((int32_t)(rel->seq - prev->seq)));
+	p = compact_put_id(p, &rec.fields, PROV_C_SND_RAW, PROV_C_SND_TYPE,
+			   PROV_C_SND_VER, st, &rel->snd, &prev->snd);
+	p = compact_put_id(p, &rec.fields, PROV_C_RCV_RAW, PROV_C_RCV_TYPE,
+			   PROV_C_RCV_VER, st, &rel->rcv, &prev->rcv);
+	if (rel->set || rel->offset) {
+		rec.fields |= PROV_C_FILE;
+		p = prov_put_varint(p, rel->set);
+		p = prov_put_varint(p, prov_zigzag(rel->offset));
+	}
+	if (rel->flags != prev->flags) {
+		rec.fields |= PROV_C_FLAGS;
+		p = prov_put_varint(p, rel->flags);
+	}
+	if (rel->task_id != prev->task_id) {
+		rec.fields |= PROV_C_TASK;
+		p = prov_put_varint(p, prov_zigzag(rel->task_id - prev->task_id));
+	}
+	if (rel->cpu != prev->cpu) {
+		rec.fields |= PROV_C_CPU;
+		p = prov_put_varint(p, rel->cpu);
+	}
+	if (rel->count) {
+		rec.fields |= PROV_C_AGG;
+		p = prov_put_varint(p, rel->count);
+		p = prov_put_varint(p, prov_zigzag(rel->ts - rel->first_ts));
+		p = prov_put_varint(p, prov_zigzag(rel->ts - rel->last_ts));
+	}
+	rec.len = p - dst;
+	if (rec.len < PROV_COMPACT_MAX) {
+		memcpy(dst, &rec, sizeof(struct prov_compact_record));
+		return rec.len;
+	}
+raw:
+	rec.len = PROV_COMPACT_MAX;
+	rec.fields = PROV_C_RAW;
+	memcpy(dst, &rec, sizeof(struct prov_compact_record));
+	memcpy(dst + sizeof(struct prov_compact_record), msg,
+	       sizeof(union prov_elt));
+	return PROV_COMPACT_MAX;
+}
+
+/*!
+ * @brief Update the stream state once an entry encoded by compact_encode has
+ * been emitted.
+ */
+static __always_inline void compact_commit(struct prov_compact_state *st,
+					   const union prov_elt *msg,
+					   size_t len)
+{
+	if (len < PROV_COMPACT_MAX)
+		memcpy(&st->prev, msg, sizeof(union prov_elt));
+}
+
+/*!
+ * @brief Write an entry to the regular relay buffer of a compact channel.
+ *
+ * The state must match the sub-buffer the entry lands in. If the entry does
+ * not fit in the current sub-buffer, relay will switch to a new one (which
+ * resets the state, see subbuf_start_handler), so the entry is encoded
+ * against a fresh state.
+ * @return false if the relay buffer is full.
+ */
+static bool compact_relay_write(struct relay_list *elt, union prov_elt *msg)
+{
+	uint8_t encoded[PROV_COMPACT_MAX];
+	struct prov_compact_state *st;
+	struct rchan_buf *buf;
+	unsigned long irqflags;
+	size_t len;
+	void *dst;
+
+	local_irq_save(irqflags);
+	buf = *this_cpu_ptr(elt->prov->buf);
+	st = this_cpu_ptr(elt->compact_state);
+	len = compact_encode(encoded, st, msg);
+	if (buf && buf->offset + len > elt->prov->subbuf_size) {
+		compact_reset(st);
+		len = compact_encode(encoded, st, msg);
+	}
+	dst = relay_reserve(elt->prov, len);
+	if (dst) {
+		memcpy(dst, encoded, len);
+		compact_commit(st, msg, len);
+	}
+	local_irq_restore(irqflags);
+	return dst != NULL;
+}
+
+/*!
+ * @brief Same as "relay_write", but report whether the entry was written.
+ *
+ * relay_reserve fails when the buffer is full (see subbuf_start_handler).
+ */
+static __always_inline bool relay_copy(struct rchan *chan,
+				       const void *data,
+				       size_t length)
+{
+	unsigned long irqflags;
+	void *dst;
+
+	local_irq_save(irqflags);
+	dst = relay_reserve(chan, length);
+	if (dst)
+		memcpy(dst, data, length);
+	local_irq_restore(irqflags);
+	return dst != NULL;
+}
+
+/*!
+ * @brief Whether an entry of "length" bytes can be reserved in the buffer of
+ * the current CPU.
+ *
+ * An entry that does not fit in the current sub-buffer needs a new one,
+ * which relay only provides if the consumer left one free. After a failed
+ * switch, offset is subbuf_size + 1 and the next switch retries the same
+ * sub-buffer.
+ */
+static bool relay_fits(struct rchan *chan, size_t length)
+{
+	struct rchan_buf *buf = *this_cpu_ptr(chan->buf);
+	size_t produced;
+
+	if (!buf)
+		return false;
+	if (buf->offset + length <= chan->subbuf_size)
+		return true;
+	produced = buf->subbufs_produced;
+	if (buf->offset <= chan->subbuf_size)
+		produced++;
+	return produced - buf->subbufs_consumed < chan->n_subbufs;
+}
+
+/*!
+ * @brief Copy a regular provenance entry to every relay channel in the list.
+ *
+ * It will write to every relay buffer in the relay_list for every CamQuery
+ * query use.
+ * This is because once provenance is read from a relay buffer, it will be
+ * consumed from the buffer.
+ * We therefore need to write to multiple relay buffers if we want to
+ * consume/use same provenance data multiple times.
+ * Channels whose filter the entry did not pass (see channel_mask) are
+ * skipped.
+ * An entry that could not be written to every channel is counted as dropped.
+ * @return false if the entry was dropped.
+ */
+static bool relay_write_all(void *msg, size_t size, uint64_t chans)
+{
+	struct relay_list *tmp;
+	bool written = true;
+	bool rc;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tmp, &relay_list, list) {
+		if (!channel_gets(tmp->bit, chans))
+			continue;
+		if (tmp->compact)
+			rc = compact_relay_write(tmp, msg);
+		else
+			rc = relay_copy(tmp->prov, msg, size);
+		if (unlikely(!rc)) {
+			atomic64_inc(&tmp->lost);
+			written = false;
+		}
+	}
+	rcu_read_unlock();
+	if (unlikely(!written))
+		count_drop(msg);
+	return written;
+}
+
+#define long_var_field(hdr, type, field, length)				  \
+	do {									  \
+		(hdr)->struct_len = sizeof(struct type);			  \
+		(hdr)->var_off = offsetof(struct type, field);			  \
+		(hdr)->var_cap = sizeof_field(struct type, field);		  \
+		(hdr)->var_len = min_t(size_t, length, sizeof_field(struct type, \
+								    field));	  \
+	} while (0)
+
+/*!
+ * @brief Describe the variable-length encoding of a long provenance entry.
+ *
+ * Each long type has at most one large buffer (e.g., a path or an argument),
+ * only its used bytes are encoded.
+ * @param msg The long provenance entry.
+ * @param hdr The header to be filled.
+ *
+ */
+static void long_header(union long_prov_elt *msg, struct prov_long_header *hdr)
+{
+	memset(hdr, 0, sizeof(struct prov_long_header));
+	hdr->magic = PROV_LONG_MAGIC;
+	switch (prov_type(msg)) {
+	case ENT_STR:
+		long_var_field(hdr, str_struct, str, msg->str_info.length);
+		break;
+	case ENT_PATH:
+		long_var_field(hdr, file_name_struct, name,
+			       msg->file_name_info.length);
+		break;
+	case ENT_ARG:
+	case ENT_ENV:
+		long_var_field(hdr, arg_struct, value,
+			       strnlen(msg->arg_info.value, PATH_MAX));
+		break;
+	case ENT_ARGS:
+		long_var_field(hdr, args_struct, value, msg->args_info.length);
+		break;
+	case ENT_ADDR:
+		long_var_field(hdr, address_struct, addr,
+			       msg->address_info.length);
+		break;
+	case ENT_PCKCNT:
+		long_var_field(hdr, pckcnt_struct, content,
+			       msg->pckcnt_info.length);
+		break;
+	case ENT_XATTR:
+		long_var_field(hdr, xattr_prov_struct, value,
+			       msg->xattr_info.size);
+		break;
+	case ENT_DISC:
+	case ACT_DISC:
+	case AGT_DISC:
+		long_var_field(hdr, disc_node_struct, content,
+			       msg->disc_node_info.length);
+		break;
+	case AGT_MACHINE:
+		hdr->struct_len = sizeof(struct machine_struct);
+		hdr->var_off = hdr->struct_len;
+		break;
+	default:
+		hdr->struct_len = sizeof(union long_prov_elt);
+		hdr->var_off = hdr->struct_len;
+		break;
+	}
+	hdr->len = ALIGN(sizeof(struct prov_long_header) + hdr->struct_len
+			 - hdr->var_cap + hdr->var_len, 8);
+}
+
+/*!
+ * @brief Encode a long provenance entry, see prov_long_decode.
+ * @param dst Destination, at least hdr->len bytes.
+ * @param hdr Header computed by long_header.
+ * @param msg The long provenance entry.
+ *
+ */
+static void long_encode(uint8_t *dst,
+			const struct prov_long_header *hdr,
+			const union long_prov_elt *msg)
+{
+	const uint8_t *src = (const uint8_t *)msg;
+	size_t tail = hdr->var_off + hdr->var_cap;
+	uint8_t *end = dst + hdr->len;
+
+	memcpy(dst, hdr, sizeof(struct prov_long_header));
+	dst += sizeof(struct prov_long_header);
+	memcpy(dst, src, hdr->var_off);
+	dst += hdr->var_off;
+	memcpy(dst, src + tail, hdr->struct_len - tail);
+	dst += hdr->struct_len - tail;
+	memcpy(dst, src + hdr->var_off, hdr->var_len);
+	dst += hdr->var_len;
+	memset(dst, 0, end - dst);
+}
+
+/*!
+ * @brief Same as "relay_write_all" for long provenance entries.
+ *
+ * Channels in variable-length mode get the encoded entry, which is built
+ * directly in the relay buffer.
+ */
+static bool long_relay_write_all(void *msg, size_t size, uint64_t chans)
+{
+	struct relay_list *tmp;
+	struct prov_long_header hdr;
+	unsigned long irqflags;
+	bool written = true;
+	bool rc;
+	void *dst;
+
+	long_header(msg, &hdr);
+	rcu_read_lock();
+	list_for_each_entry_rcu(tmp, &relay_list, list) {
+		if (!channel_gets(tmp->bit, chans))
+			continue;
+		if (!tmp->varlen)
+			rc = relay_copy(tmp->long_prov, msg, size);
+		else {
+			local_irq_save(irqflags);
+			dst = relay_reserve(tmp->long_prov, hdr.len);
+			if (dst)
+				long_encode(dst, &hdr, msg);
+			local_irq_restore(irqflags);
+			rc = dst != NULL;
+		}
+		if (unlikely(!rc)) {
+			atomic64_inc(&tmp->long_lost);
+			written = false;
+		}
+	}
+	rcu_read_unlock();
+	if (unlikely(!written))
+		count_drop(msg);
+	return written;
+}
+
+/*!
+ * @brief Whether an entry can be written to every relay channel it is
+ * delivered to without being dropped.
+ *
+ * Sizes are upper bounds of the encoded entry. Must be called with
+ * preemption disabled.
+ */
+static bool relay_fits_all(bool is_long, size_t size, uint64_t chans)
+{
+	struct relay_list *tmp;
+	bool rc = true;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tmp, &relay_list, list) {
+		if (!channel_gets(tmp->bit, chans))
+			continue;
+		if (is_long)
+			rc = relay_fits(tmp->long_prov, tmp->varlen ?
+					sizeof(struct prov_long_header)
+					+ size + 8 : size);
+		else
+			rc = relay_fits(tmp->prov, tmp->compact ?
+					PROV_COMPACT_MAX : size);
+		if (!rc)
+			break;
+	}
+	rcu_read_unlock();
+	return rc;
+}
+
+/*!
+ * @brief Per-CPU single producer single consumer staging ring.
+ *
+ * Hooks append entries to the ring of the CPU they run on, and a work item
+ * bound to that CPU moves them to the relay channels in batches.
+ * The producer only ever writes "head" and the consumer only ever writes
+ * "tail", so no lock or shared cache line is involved on the record path.
+ * Producers nesting on the same CPU (e.g., softirq interrupting a syscall)
+ * are serialised by disabling local interrupts while a slot is filled.
+ * Indexes are free running and wrapped with "mask" (size is a power of two).
+ *
+ * The same structure holds the shared logs read by cursor channels (see
+ * prov_create_channel). A log has no consumer: it is written alongside the
+ * staging ring, never drained, and its oldest entry is overwritten when it
+ * is full. Cursors that fall more than a log behind are lapped and count
+ * the entries they lost. "seq" lets a cursor detect that a slot was
+ * overwritten while it was being copied.
+ */
+struct prov_ring_buf {
+	uint8_t *data;
+	// Position of the entry held by each slot, used by cursors.
+	unsigned int *seq;
+	// Channels each entry is delivered to, see channel_mask.
+	uint64_t *chans;
+	size_t elt_size;
+	unsigned int mask;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int max_depth;
+};
+
+struct prov_ring {
+	struct prov_ring_buf buf;
+	struct prov_ring_buf long_buf;
+	// Entries recorded before relay is ready, see insert_boot_buffer.
+	struct prov_ring_buf boot;
+	struct prov_ring_buf long_boot;
+	// Shared logs read by cursor channels, see prov_log_alloc.
+	struct prov_ring_buf log;
+	struct prov_ring_buf long_log;
+	// Deferred kick, safe from any context the hooks may run in.
+	struct irq_work kick;
+	// Delayed when relay is full and entries are held back.
+	struct delayed_work work;
+	// Cursor readers waiting for new entries.
+	wait_queue_head_t wait;
+	int cpu;
+	// Drain waits for room in relay, see prov_relay_consumed.
+	bool stalled;
+	// Statistics exposed through securityfs, see struct prov_ring_info.
+	uint64_t kicked;
+	uint64_t drained;
+	uint64_t overflow;
+	uint64_t drain_latency;
+	uint64_t max_drain_latency;
+	uint64_t drain_duration;
+	uint64_t max_drain_duration;
+	uint64_t boot_overflow;
+	uint64_t long_boot_overflow;
+	uint64_t boot_drained;
+	uint64_t long_boot_drained;
+};
+
+static DEFINE_PER_CPU(struct prov_ring, prov_rings);
+static struct workqueue_struct *prov_ring_wq;
+static unsigned int prov_ring_size = PROV_RING_SIZE;
+static unsigned int prov_long_ring_size = PROV_LONG_RING_SIZE;
+static unsigned int prov_log_size = PROV_LOG_SIZE;
+static unsigned int prov_long_log_size = PROV_LONG_LOG_SIZE;
+
+/*!
+ * @brief Parse "provenance_ring=<entries>[,<long entries>]" boot parameter.
+ *
+ * Sizes are per CPU and rounded up to a power of two.
+ * A size of 0 disables the corresponding ring (entries are then written
+ * directly to relay).
+ */
+static int __init prov_ring_setup(char *str)
+{
+	int ints[3];
+
+	get_options(str, ARRAY_SIZE(ints), ints);
+	if (ints[0] > 0 && ints[1] >= 0)
+		prov_ring_size = ints[1] ? roundup_pow_of_two(ints[1]) : 0;
+	if (ints[0] > 1 && ints[2] >= 0)
+		prov_long_ring_size = ints[2] ? roundup_pow_of_two(ints[2]) : 0;
+	return 1;
+}
+__setup("provenance_ring=", prov_ring_setup);
+
+/*!
+ * @brief Parse "provenance_log=<entries>[,<long entries>]" boot parameter.
+ *
+ * Sizes of the per-CPU shared logs read by cursor channels, rounded up to a
+ * power of two. The logs are only allocated when the first shared channel is
+ * created. A size below 2 disables shared channels.
+ */
+static int __init prov_log_setup(char *str)
+{
+	int ints[3];
+
+	get_options(str, ARRAY_SIZE(ints), ints);
+	if (ints[0] > 0 && ints[1] >= 0)
+		prov_log_size = ints[1] ? roundup_pow_of_two(ints[1]) : 0;
+	if (ints[0] > 1 && ints[2] >= 0)
+		prov_long_log_size = ints[2] ? roundup_pow_of_two(ints[2]) : 0;
+	return 1;
+}
+__setup("provenance_log=", prov_log_setup);
+
+static __always_inline bool prov_log_enabled(void)
+{
+	return prov_log_size > 1 && prov_long_log_size > 1;
+}
+
+static __always_inline unsigned int ring_depth(struct prov_ring_buf *rb)
+{
+	return READ_ONCE(rb->head) - READ_ONCE(rb->tail);
+}
+
+static DEFINE_PER_CPU(uint32_t, prov_next_seq);
+
+/*!
+ * @brief Stamp an entry with its position in the total order (see
+ * "Ordering" in provenance.h).
+ *
+ * Must be called with interrupts disabled, in the same section that hands
+ * the entry over to the ring or to relay, so that stamps follow the order
+ * of the per-CPU files.
+ * The entry is owned by the caller (a relation on its stack or a node under
+ * its lock).
+ */
+static __always_inline void prov_stamp(void *msg)
+{
+	union prov_elt *elt = msg;
+
+	prov_ts(elt) = ktime_get_mono_fast_ns();
+	prov_cpu(elt) = smp_processor_id();
+	prov_seq(elt) = __this_cpu_inc_return(prov_next_seq);
+}
+
+/* Write the entry at the head of a ring, whether its slot is free or not. */
+static __always_inline void ring_fill(struct prov_ring_buf *rb,
+				      void *msg,
+				      size_t size,
+				      uint64_t chans)
+{
+	unsigned int head = rb->head;
+	unsigned int slot = head & rb->mask;
+
+	// head + 1 is never a position held by this slot: marks it busy.
+	WRITE_ONCE(rb->seq[slot], head + 1);
+	smp_wmb();
+	__memcpy_ss(rb->data + slot * rb->elt_size, rb->elt_size, msg, size);
+	rb->chans[slot] = chans;
+	smp_store_release(&rb->seq[slot], head);
+	smp_store_release(&rb->head, head + 1);
+}
+
+static __always_inline bool ring_push(struct prov_ring_buf *rb,
+				      void *msg,
+				      size_t size,
+				      uint64_t chans)
+{
+	unsigned int depth;
+
+	if (unlikely(!rb->data))
+		return false;
+	// Pairs with release in ring_pop, slot must be consumed before reuse.
+	depth = rb->head - smp_load_acquire(&rb->tail);
+	if (unlikely(depth > rb->mask))
+		return false;
+	prov_stamp(msg);
+	ring_fill(rb, msg, size, chans);
+	if (unlikely(depth + 1 > rb->max_depth))
+		rb->max_depth = depth + 1;
+	return true;
+}
+
+/*!
+ * @brief Append a stamped entry to the shared log of the current CPU.
+ *
+ * Must be called with interrupts disabled, in the section that stamped the
+ * entry, so that the log follows the order of the per-CPU files. Nothing is
+ * written until a shared channel has been created (see prov_log_alloc).
+ */
+static __always_inline void log_append(struct prov_ring *ring,
+				       bool is_long,
+				       void *msg,
+				       size_t size,
+				       uint64_t chans)
+{
+	struct prov_ring_buf *rb = is_long ? &ring->long_log : &ring->log;
+
+	// Pairs with release in prov_log_alloc.
+	if (likely(!smp_load_acquire(&rb->data)))
+		return;
+	ring_fill(rb, msg, size, chans);
+}
+
+static __always_inline void ring_kick(struct prov_ring *ring)
+{
+	/*
+	 * The head must be visible before we test whether the drain is pending.
+	 * Pairs with the barrier the workqueue issues when clearing pending.
+	 */
+	smp_mb();
+	if (!delayed_work_pending(&ring->work))
+		irq_work_queue(&ring->kick);
+}
+
+/*!
+ * @brief Append an entry to the staging ring of the current CPU.
+ * @param is_long Whether the entry is a long provenance entry.
+ * @param msg The entry.
+ * @param size Size of the entry.
+ * @param chans Channels the entry is delivered to.
+ * @return true if the entry was staged, false if the ring is full or not
+ * allocated (see prov_stage).
+ *
+ */
+static __always_inline bool ring_enqueue(bool is_long,
+					 void *msg,
+					 size_t size,
+					 uint64_t chans)
+{
+	struct prov_ring *ring;
+	unsigned long irqflags;
+	bool rc;
+
+	local_irq_save(irqflags);
+	ring = this_cpu_ptr(&prov_rings);
+	if (is_long)
+		rc = ring_push(&ring->long_buf, msg, size, chans);
+	else
+		rc = ring_push(&ring->buf, msg, size, chans);
+	if (likely(rc)) {
+		log_append(ring, is_long, msg, size, chans);
+		ring_kick(ring);
+	}
+	local_irq_restore(irqflags);
+	return rc;
+}
+
+/*!
+ * @brief Move the oldest entry of a ring to relay.
+ *
+ * Must be called with interrupts disabled on the CPU of the ring, which
+ * serialises the drain and the overflow path (see ring_overflow).
+ * @param rb The ring.
+ * @param is_long Whether the ring holds long provenance entries.
+ * @param hold Leave the entry in the ring if relay cannot take it.
+ * @param stalled Set if the entry was held back.
+ * @return false if the ring is empty or the entry was held back.
+ *
+ */
+static bool ring_pop(struct prov_ring_buf *rb, bool is_long, bool hold,
+		     bool *stalled)
+{
+	unsigned int tail = rb->tail;
+	uint64_t chans;
+	void *entry;
+
+	// Pairs with release in ring_push, slot content is visible.
+	if (tail == smp_load_acquire(&rb->head))
+		return false;
+	entry = rb->data + (tail & rb->mask) * rb->elt_size;
+	chans = rb->chans[tail & rb->mask];
+	if (hold && !relay_fits_all(is_long, rb->elt_size, chans)) {
+		*stalled = true;
+		return false;
+	}
+	if (is_long)
+		long_relay_write_all(entry, rb->elt_size, chans);
+	else
+		relay_write_all(entry, rb->elt_size, chans);
+	smp_store_release(&rb->tail, tail + 1);
+	return true;
+}
+
+/*!
+ * @brief Hand an entry over to relay when the staging ring is full (or not
+ * allocated).
+ *
+ * The oldest staged entry is moved to relay to make room, rather than
+ * writing the new entry to relay ahead of older ones, so that the per-CPU
+ * files stay ordered (see "Ordering" in provenance.h). The entry is appended
+ * to the shared log either way.
+ */
+static void ring_overflow(bool is_long, void *msg, size_t size, uint64_t chans)
+{
+	struct prov_ring_buf *rb;
+	struct prov_ring *ring;
+	unsigned long irqflags;
+
+	local_irq_save(irqflags);
+	ring = this_cpu_ptr(&prov_rings);
+	rb = is_long ? &ring->long_buf : &ring->buf;
+	if (rb->data) {
+		ring->overflow++;
+		ring_pop(rb, is_long, false, NULL);
+		if (ring_push(rb, msg, size, chans)) {
+			log_append(ring, is_long, msg, size, chans);
+			ring_kick(ring);
+			goto out;
+		}
+	}
+	prov_stamp(msg);
+	if (is_long)
+		long_relay_write_all(msg, size, chans);
+	else
+		relay_write_all(msg, size, chans);
+	log_append(ring, is_long, msg, size, chans);
+	// Wakes up cursor readers (see prov_ring_drain).
+	if (ring->log.data)
+		ring_kick(ring);
+out:
+	local_irq_restore(irqflags);
+}
+
+static void prov_ring_kick(struct irq_work *kick)
+{
+	struct prov_ring *ring = container_of(kick, struct prov_ring, kick);
+
+	if (queue_delayed_work_on(ring->cpu, prov_ring_wq, &ring->work, 0))
+		WRITE_ONCE(ring->kicked, ktime_get_mono_fast_ns());
+}
+
+/*!
+ * @brief Move at most PROV_RING_BATCH entries from a ring to relay.
+ *
+ * Under PROV_OVERFLOW_THROTTLE, entries that relay cannot take are left in
+ * the ring rather than dropped.
+ * Entries are moved one at a time with interrupts disabled, the overflow
+ * path may move entries in between (see ring_overflow).
+ * @param rb The ring.
+ * @param is_long Whether the ring holds long provenance entries.
+ * @param stalled Set if entries were held back.
+ * @return The number of entries moved.
+ *
+ */
+static unsigned int ring_drain(struct prov_ring_buf *rb, bool is_long,
+			       bool *stalled)
+{
+	bool hold = READ_ONCE(prov_overflow.mode) == PROV_OVERFLOW_THROTTLE;
+	unsigned long irqflags;
+	unsigned int n = 0;
+	bool moved;
+
+	if (!rb->data)
+		return 0;
+	while (n < PROV_RING_BATCH) {
+		local_irq_save(irqflags);
+		moved = ring_pop(rb, is_long, hold, stalled);
+		local_irq_restore(irqflags);
+		if (!moved)
+			break;
+		n++;
+	}
+	return n;
+}
+
+static void prov_ring_drain(struct work_struct *work)
+{
+	struct prov_ring *ring = container_of(to_delayed_work(work),
+					      struct prov_ring, work);
+	uint64_t start = ktime_get_mono_fast_ns();
+	uint64_t latency = start - READ_ONCE(ring->kicked);
+	uint64_t duration;
+	bool stalled = false;
+	unsigned int n;
+
+	do {
+		// The work is bound to the CPU of the ring, see ring_pop.
+		preempt_disable();
+		n = ring_drain(&ring->buf, false, &stalled);
+		n += ring_drain(&ring->long_buf, true, &stalled);
+		preempt_enable();
+		ring->drained += n;
+		cond_resched();
+	} while (n > 0 && !stalled);
+	if (wq_has_sleeper(&ring->wait))
+		wake_up_interruptible(&ring->wait);
+	/*
+	 * Relay is full, retry once the consumer read (see
+	 * prov_relay_consumed) or had a chance to catch up.
+	 */
+	WRITE_ONCE(ring->stalled, stalled);
+	if (stalled)
+		queue_delayed_work_on(ring->cpu, prov_ring_wq, &ring->work, 1);
+
+	duration = ktime_get_mono_fast_ns() - start;
+	ring->drain_latency = latency;
+	if (latency > ring->max_drain_latency)
+		ring->max_drain_latency = latency;
+	ring->drain_duration = duration;
+	if (duration > ring->max_drain_duration)
+		ring->max_drain_duration = duration;
+}
+
+static void ring_free(struct prov_ring_buf *rb)
+{
+	kvfree(rb->data);
+	kvfree(rb->seq);
+	kvfree(rb->chans);
+	rb->data = NULL;
+	rb->seq = NULL;
+	rb->chans = NULL;
+}
+
+/*
+ * Staging and boot rings are allocated on the node of their CPU, the only
+ * buffers the record path writes to.
+ */
+static int ring_alloc(struct prov_ring_buf *rb, unsigned int size,
+		      size_t elt_size, int cpu)
+{
+	rb->elt_size = elt_size;
+	if (!size)
+		return 0;
+	rb->seq = kvzalloc_node(size * sizeof(unsigned int), GFP_KERNEL,
+				cpu_to_node(cpu));
+	rb->chans = kvzalloc_node(size * sizeof(uint64_t), GFP_KERNEL,
+				  cpu_to_node(cpu));
+	rb->data = kvzalloc_node(size * elt_size, GFP_KERNEL, cpu_to_node(cpu));
+	if (!rb->seq || !rb->chans || !rb->data) {
+		ring_free(rb);
+		return -ENOMEM;
+	}
+	rb->mask = size - 1;
+	return 0;
+}
+
+static void prov_ring_init(void)
+{
+	struct prov_ring *ring;
+	int cpu;
+
+	prov_ring_wq = alloc_workqueue("prov_ring", WQ_HIGHPRI, 0);
+	if (!prov_ring_wq) {
+		pr_err("Provenance: could not allocate ring workqueue.");
+		return;
+	}
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		ring->cpu = cpu;
+		init_irq_work(&ring->kick, prov_ring_kick);
+		INIT_DELAYED_WORK(&ring->work, prov_ring_drain);
+		init_waitqueue_head(&ring->wait);
+		if (ring_alloc(&ring->buf, prov_ring_size,
+			       sizeof(union prov_elt), cpu))
+			pr_err("Provenance: could not allocate ring on cpu %d.",
+			       cpu);
+		if (ring_alloc(&ring->long_buf, prov_long_ring_size,
+			       sizeof(union long_prov_elt), cpu))
+			pr_err("Provenance: could not allocate long ring on cpu %d.",
+			       cpu);
+	}
+	pr_info("Provenance: staging rings %u/%u entries per cpu.",
+		prov_ring_size, prov_long_ring_size);
+}
+
+/*!
+ * @brief Synchronously move every staged entry to relay.
+ *
+ * Must be called from process context.
+ */
+void prov_ring_flush(void)
+{
+	struct prov_ring *ring;
+	int cpu;
+
+	if (!prov_ring_wq)
+		return;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		mod_delayed_work_on(cpu, prov_ring_wq, &ring->work, 0);
+		flush_delayed_work(&ring->work);
+	}
+}
+
+/*!
+ * @brief Fill staging ring statistics, one entry per possible CPU.
+ * @param info Array to be filled.
+ * @param nr Number of entries in the array.
+ * @return Number of entries filled.
+ *
+ */
+size_t prov_ring_info(struct prov_ring_info *info, size_t nr)
+{
+	struct prov_ring *ring;
+	size_t i = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (i >= nr)
+			break;
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		info[i].cpu = cpu;
+		info[i].size = ring->buf.data ? ring->buf.mask + 1 : 0;
+		info[i].depth = ring_depth(&ring->buf);
+		info[i].max_depth = READ_ONCE(ring->buf.max_depth);
+		info[i].long_size = ring->long_buf.data ?
+				    ring->long_buf.mask + 1 : 0;
+		info[i].long_depth = ring_depth(&ring->long_buf);
+		info[i].long_max_depth = READ_ONCE(ring->long_buf.max_depth);
+		info[i].drained = READ_ONCE(ring->drained);
+		info[i].overflow = READ_ONCE(ring->overflow);
+		info[i].drain_latency = READ_ONCE(ring->drain_latency);
+		info[i].max_drain_latency = READ_ONCE(ring->max_drain_latency);
+		info[i].drain_duration = READ_ONCE(ring->drain_duration);
+		info[i].max_drain_duration = READ_ONCE(ring->max_drain_duration);
+		info[i].boot_overflow = READ_ONCE(ring->boot_overflow);
+		info[i].long_boot_overflow = READ_ONCE(ring->long_boot_overflow);
+		info[i].boot_depth = ring_depth(&ring->boot);
+		info[i].long_boot_depth = ring_depth(&ring->long_boot);
+		info[i].boot_drained = READ_ONCE(ring->boot_drained);
+		info[i].long_boot_drained = READ_ONCE(ring->long_boot_drained);
+		i++;
+	}
+	return i;
+}
+
+static unsigned int prov_boot_size = PROV_BOOT_RING_SIZE;
+static unsigned int prov_long_boot_size = PROV_LONG_BOOT_RING_SIZE;
+
+/*!
+ * @brief Parse "provenance_boot=<entries>[,<long entries>]" boot parameter.
+ *
+ * Sizes of the per-CPU boot buffers, rounded up to a power of two.
+ * Entries recorded before relay is ready that do not fit are counted as
+ * boot overflow (see struct prov_ring_info).
+ */
+static int __init prov_boot_setup(char *str)
+{
+	int ints[3];
+
+	get_options(str, ARRAY_SIZE(ints), ints);
+	if (ints[0] > 0 && ints[1] >= 0)
+		prov_boot_size = ints[1] ? roundup_pow_of_two(ints[1]) : 0;
+	if (ints[0] > 1 && ints[2] >= 0)
+		prov_long_boot_size = ints[2] ? roundup_pow_of_two(ints[2]) : 0;
+	return 1;
+}
+__setup("provenance_boot=", prov_boot_setup);
+
+/*!
+ * @brief Allocate the per-CPU boot buffers.
+ *
+ * Called at LSM initialisation, before any provenance is recorded.
+ * The buffers are freed once drained (see handle_boot_buffer).
+ */
+void __init prov_boot_buffer_init(void)
+{
+	struct prov_ring *ring;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		if (ring_alloc(&ring->boot, prov_boot_size,
+			       sizeof(union prov_elt), cpu))
+			pr_err("Provenance: could not allocate boot buffer on cpu %d.",
+			       cpu);
+		if (ring_alloc(&ring->long_boot, prov_long_boot_size,
+			       sizeof(union long_prov_elt), cpu))
+			pr_err("Provenance: could not allocate long boot buffer on cpu %d.",
+			       cpu);
+	}
+	pr_info("Provenance: boot buffers %u/%u entries per cpu.",
+		prov_boot_size, prov_long_boot_size);
+}
+
+bool relay_ready;
+static bool relay_initialized;
+
+/*!
+ * @brief Append an entry recorded before relay is ready to the boot buffer
+ * of the current CPU.
+ *
+ * Order is preserved per CPU, as it is in relay. Entries that do not fit
+ * are counted as boot overflow.
+ * The test of relay_ready and the append happen with interrupts disabled,
+ * so that handle_boot_buffer can wait for appends in progress with
+ * synchronize_rcu.
+ * @param is_long Whether the entry is a long provenance entry.
+ * @param msg The entry.
+ * @param size Size of the entry.
+ * @return false if relay became ready (the entry must go to relay).
+ *
+ */
+static bool insert_boot_buffer(bool is_long, void *msg, size_t size)
+{
+	struct prov_ring *ring;
+	unsigned long irqflags;
+	bool rc = true;
+
+	local_irq_save(irqflags);
+	if (READ_ONCE(relay_ready)) {
+		rc = false;
+		goto out;
+	}
+	ring = this_cpu_ptr(&prov_rings);
+	if (is_long) {
+		if (unlikely(!ring_push(&ring->long_boot, msg, size,
+					PROV_ALL_CHANNELS))) {
+			ring->long_boot_overflow++;
+			if (prov_type((union prov_elt *)msg) == ENT_PATH)
+				prov_intern_flush();
+		}
+	} else {
+		if (unlikely(!ring_push(&ring->boot, msg, size,
+					PROV_ALL_CHANNELS)))
+			ring->boot_overflow++;
+	}
+out:
+	local_irq_restore(irqflags);
+	return rc;
+}
+
+/*!
+ * @brief Move at most PROV_RING_BATCH entries of a boot buffer to relay.
+ * @param rb The boot buffer.
+ * @param is_long Whether the buffer holds long provenance entries.
+ * @return The number of entries moved, or -ENOSPC if relay is full (what is
+ * left will be moved once the consumer makes room).
+ *
+ */
+static int boot_drain(struct prov_ring_buf *rb, bool is_long)
+{
+	unsigned int tail = rb->tail;
+	unsigned int head;
+	union prov_elt *entry;
+	int n = 0;
+
+	if (!rb->data)
+		return 0;
+	// Pairs with release in ring_push, slot content is visible.
+	head = smp_load_acquire(&rb->head);
+	preempt_disable();
+	while (tail != head && n < PROV_RING_BATCH) {
+		// check if relay is full
+		if (!relay_fits_all(is_long, rb->elt_size, PROV_ALL_CHANNELS)) {
+			n = -ENOSPC;
+			break;
+		}
+		entry = (union prov_elt *)(rb->data + (tail & rb->mask)
+					   * rb->elt_size);
+		// tighten provenance entry
+		tighten_identifier(&get_prov_identifier(entry));
+		set_replayed(entry);
+		if (!is_long && prov_is_relation(entry)) {
+			tighten_identifier(&(entry->relation_info.snd));
+			tighten_identifier(&(entry->relation_info.rcv));
+		}
+		if (is_long)
+			long_relay_write_all(entry, rb->elt_size,
+					     PROV_ALL_CHANNELS);
+		else
+			relay_write_all(entry, rb->elt_size, PROV_ALL_CHANNELS);
+		tail++;
+		n++;
+	}
+	preempt_enable();
+	smp_store_release(&rb->tail, tail);
+	return n;
+}
+
+/*!
+ * @brief Drain every boot buffer of a kind, one batch at a time.
+ *
+ * Interrupts are only disabled while an entry is copied to relay, and the
+ * worker reschedules between batches.
+ * @return false if relay is full.
+ *
+ */
+static bool boot_drain_all(bool is_long)
+{
+	struct prov_ring *ring;
+	int cpu;
+	int n;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		do {
+			if (is_long) {
+				n = boot_drain(&ring->long_boot, true);
+				if (n > 0)
+					ring->long_boot_drained += n;
+			} else {
+				n = boot_drain(&ring->boot, false);
+				if (n > 0)
+					ring->boot_drained += n;
+			}
+			if (n < 0)
+				return false;
+			cond_resched();
+		} while (n > 0);
+	}
+	return true;
+}
+
+static void prov_boot_drain(struct work_struct *work);
+static DECLARE_DELAYED_WORK(boot_work, prov_boot_drain);
+// Boot drain waits for the consumer, see prov_relay_consumed.
+static bool boot_stalled;
+static uint64_t boot_start;
+
+/*!
+ * @brief Empty the boot buffers of every CPU, then free them.
+ *
+ * relay_ready is set before the drain is first queued. Once an RCU grace
+ * period has elapsed, no append can be in progress (see insert_boot_buffer)
+ * and the buffers are drained one last time before being freed.
+ * If relay is full, the drain resumes as soon as a consumer reads from
+ * relay (see prov_relay_consumed), or after a second for consumers that do
+ * not read through the relay files.
+ * Progress is reported per CPU through securityfs (see struct
+ * prov_ring_info).
+ */
+static void prov_boot_drain(struct work_struct *work)
+{
+	struct prov_ring *ring;
+	uint64_t drained = 0;
+	uint64_t overflow = 0;
+	int cpu;
+
+	WRITE_ONCE(boot_stalled, false);
+	if (!boot_drain_all(false) || !boot_drain_all(true))
+		goto stalled;
+	synchronize_rcu();
+	if (!boot_drain_all(false) || !boot_drain_all(true))
+		goto stalled;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		ring_free(&ring->boot);
+		ring_free(&ring->long_boot);
+		drained += ring->boot_drained + ring->long_boot_drained;
+		overflow += ring->boot_overflow + ring->long_boot_overflow;
+	}
+	pr_info("Provenance: boot buffers drained, %llu entries in %llu ms.",
+		drained, div_u64(ktime_get_mono_fast_ns() - boot_start,
+				 NSEC_PER_MSEC));
+	if (overflow)
+		pr_warn("Provenance: %llu boot entries did not fit in the boot buffers.",
+			overflow);
+	return;
+stalled:
+	WRITE_ONCE(boot_stalled, true);
+	queue_delayed_work(system_unbound_wq, &boot_work, HZ);
+}
+
+/*!
+ * @brief Write whatever in boot buffer to relay buffer when relay buffer is
+ * ready.
+ *
+ * This function writes what's in the boot buffers to relay buffer for
+ * regular provenance entries, and what's in the long boot buffers to relay
+ * buffer for long provenance entries (see prov_boot_drain).
+ * It also frees memory after it is done writing.
+ * Once done, set boolean value relay_ready to true to signal that relay buffer
+ * is ready to be used.
+ *
+ */
+void write_boot_buffer(void)
+{
+	unsigned long irqflags;
+
+	if (prov_machine_id == 0 || prov_boot_id == 0 || !relay_initialized)
+		return;
+
+	WRITE_ONCE(relay_ready, true);
+
+	refresh_prov_machine();
+	local_irq_save(irqflags);
+	prov_stamp(prov_machine);
+	long_relay_write_all(prov_machine, sizeof(union long_prov_elt),
+			     PROV_ALL_CHANNELS);
+	local_irq_restore(irqflags);
+
+	// asynchronously empty the buffers
+	boot_start = ktime_get_mono_fast_ns();
+	queue_delayed_work(system_unbound_wq, &boot_work, 0);
+}
+
+/*!
+ * @brief Called when a consumer has read from a relay buffer.
+ *
+ * Drains waiting for room in relay (i.e., the boot drain and, under
+ * PROV_OVERFLOW_THROTTLE, the staging ring drains) are resumed immediately
+ * rather than on their next retry.
+ */
+static void prov_relay_consumed(void)
+{
+	struct prov_ring *ring;
+	int cpu;
+
+	if (READ_ONCE(boot_stalled))
+		mod_delayed_work(system_unbound_wq, &boot_work, 0);
+	if (!prov_ring_wq)
+		return;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		if (READ_ONCE(ring->stalled))
+			mod_delayed_work_on(cpu, prov_ring_wq, &ring->work, 0);
+	}
+}
+
+/*!
+ * @brief A consumer of the shared per-CPU log.
+ *
+ * Each cursor channel owns one cursor per CPU and per log (regular and long).
+ * A cursor is only a position in the log, entries are never copied on its
+ * behalf.
+ */
+struct prov_cursor {
+	struct prov_ring *ring;
+	struct prov_ring_buf *rb;
+	struct mutex lock;
+	unsigned int pos;
+	// Entries overwritten before this cursor read them.
+	uint64_t lost;
+	// Long entries are read in variable-length form.
+	bool varlen;
+	// Regular entries are read as a compact stream.
+	bool compact;
+	struct prov_compact_state compact_state;
+	// Bit of the channel filter, 0 if the channel gets every entry.
+	uint64_t bit;
+	// File of the cursor, removed with it (see cursors_free).
+	struct dentry *dentry;
+};
+
+struct cursor_list {
+	struct list_head list;
+	char *name;
+	struct prov_cursor *cursors;
+	struct prov_cursor *long_cursors;
+	struct prov_channel_opts opts;
+};
+static LIST_HEAD(cursor_list);
+static DEFINE_MUTEX(channel_lock);
+
+enum ring_peek_rc {
+	RING_PEEK_LOST,
+	RING_PEEK_FILTERED,
+	RING_PEEK_OK,
+};
+
+/*!
+ * @brief Copy the entry at position "pos" out of the ring.
+ * @param rb The ring.
+ * @param pos Position of the entry.
+ * @param dst Destination of the entry.
+ * @param bit Filter bit of the reader, entries it does not get are not
+ * copied.
+ * @return RING_PEEK_LOST if the entry has been (or is being) overwritten.
+ *
+ */
+static enum ring_peek_rc ring_peek(struct prov_ring_buf *rb, unsigned int pos,
+				   void *dst, uint64_t bit)
+{
+	unsigned int slot = pos & rb->mask;
+	enum ring_peek_rc rc = RING_PEEK_OK;
+
+	// Pairs with release in ring_push.
+	if (smp_load_acquire(&rb->seq[slot]) != pos)
+		return RING_PEEK_LOST;
+	if (channel_gets(bit, READ_ONCE(rb->chans[slot])))
+		memcpy(dst, rb->data + slot * rb->elt_size, rb->elt_size);
+	else
+		rc = RING_PEEK_FILTERED;
+	smp_rmb();
+	if (READ_ONCE(rb->seq[slot]) != pos)
+		return RING_PEEK_LOST;
+	return rc;
+}
+
+/*!
+ * @brief Encode an entry according to the options of the cursor.
+ * @param cur The cursor.
+ * @param entry The entry, as stored in the ring.
+ * @param encoded Buffer for the encoded entry.
+ * @param out Set to the data to be copied to userspace.
+ * @return The length of the data to be copied to userspace.
  *
- * @todo Failure case checking is missing.
  */
-void prov_add_relay(char *name, struct rchan *prov, struct rchan *long_prov)
+static size_t cursor_encode(struct prov_cursor *cur, void *entry,
+			    uint8_t *encoded, void **out)
 {
-	struct relay_list *elt;
+	struct prov_long_header hdr;
 
-	elt = kzalloc(sizeof(struct relay_list), GFP_KERNEL);
-	elt->name = name;
-	elt->prov = prov;
-	elt->long_prov = long_prov;
-	list_add_tail(&(elt->list), &relay_list);
+	if (cur->varlen) {
+		long_header(entry, &hdr);
+		long_encode(encoded, &hdr, entry);
+		*out = encoded;
+		return hdr.len;
+	}
+	if (cur->compact) {
+		*out = encoded;
+		return compact_encode(encoded, &cur->compact_state, entry);
+	}
+	*out = entry;
+	return cur->rb->elt_size;
 }
 
 /*!
- * @brief Flush every relay buffer element in the relay list.
+ * @brief Read as many whole entries as fit in the user buffer.
+ *
+ * Like relay files, reading does not block and returns 0 when no entry is
+ * available.
+ * On compact channels, each read starts with a stream header.
  */
-void prov_flush(void)
+static ssize_t cursor_read(struct file *filp, char __user *buf,
+			   size_t count, loff_t *ppos)
 {
-	struct relay_list *tmp;
+	struct prov_cursor *cur = filp->private_data;
+	struct prov_ring_buf *rb = cur->rb;
+	struct prov_compact_header chdr;
+	uint8_t *encoded = NULL;
+	unsigned int entries = 0;
+	unsigned int head;
+	unsigned int pos;
+	size_t done = 0;
+	ssize_t rc = 0;
+	size_t size;
+	void *entry;
+	void *out;
 
-	if (unlikely(!relay_ready))
-		return;
+	if (!count)
+		return 0;
+	entry = kmalloc(rb->elt_size, GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+	if (cur->varlen || cur->compact) {
+		encoded = kmalloc(sizeof(struct prov_long_header)
+				  + rb->elt_size + 8, GFP_KERNEL);
+		if (!encoded) {
+			kfree(entry);
+			return -ENOMEM;
+		}
+	}
 
-	list_for_each_entry(tmp, &relay_list, list) {
-		relay_flush(tmp->prov);
-		relay_flush(tmp->long_prov);
+	mutex_lock(&cur->lock);
+	pos = cur->pos;
+	while (done < count) {
+		head = smp_load_acquire(&rb->head);
+		if (pos == head)
+			break;
+		// Lost entries may be path nodes, see intern.c.
+		if (head - pos > rb->mask + 1) {
+			cur->lost += head - pos - (rb->mask + 1);
+			pos = head - (rb->mask + 1);
+			prov_intern_flush();
+		}
+		switch (ring_peek(rb, pos, entry, cur->bit)) {
+		case RING_PEEK_LOST:
+			cur->lost++;
+			prov_intern_flush();
+			fallthrough;
+		case RING_PEEK_FILTERED:
+			pos++;
+			continue;
+		case RING_PEEK_OK:
+			break;
+		}
+		if (cur->compact && !done) {
+			compact_reset(&cur->compact_state);
+			compact_header(&chdr, &cur->compact_state);
+			if (count < sizeof(struct prov_compact_header)) {
+				rc = -EINVAL;
+				break;
+			}
+			if (copy_to_user(buf, &chdr,
+					 sizeof(struct prov_compact_header))) {
+				rc = -EFAULT;
+				break;
+			}
+			done += sizeof(struct prov_compact_header);
+		}
+		size = cursor_encode(cur, entry, encoded, &out);
+		if (done + size > count) {
+			// Entry does not fit, it will be read next time.
+			if (!entries) {
+				done = 0;
+				rc = -EINVAL;
+			}
+			break;
+		}
+		if (copy_to_user(buf + done, out, size)) {
+			rc = -EFAULT;
+			break;
+		}
+		if (cur->compact)
+			compact_commit(&cur->compact_state, entry, size);
+		done += size;
+		entries++;
+		pos++;
 	}
+	cur->pos = pos;
+	mutex_unlock(&cur->lock);
+	kfree(encoded);
+	kfree(entry);
+	if (entries)
+		return done;
+	return rc;
 }
 
-/* Global variables: variable declarations in provenance.h */
-static struct rchan *prov_chan;
-static struct rchan *long_prov_chan;
-atomic64_t prov_relation_id = ATOMIC64_INIT(0);
-atomic64_t prov_node_id = ATOMIC64_INIT(0);
+static __poll_t cursor_poll(struct file *filp, poll_table *wait)
+{
+	struct prov_cursor *cur = filp->private_data;
+
+	poll_wait(filp, &cur->ring->wait, wait);
+	if (READ_ONCE(cur->pos) != smp_load_acquire(&cur->rb->head))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations cursor_file_operations = {
+	.open = simple_open,
+	.read = cursor_read,
+	.poll = cursor_poll,
+	.llseek = no_llseek,
+};
 
-bool is_relay_full(struct rchan *chan)
+static void cursors_free(struct prov_cursor *cursors)
 {
-	int ret;
-	int rc = 0;
-	struct rchan_buf *buf = *this_cpu_ptr(chan->buf);
+	int cpu;
+
+	if (!cursors)
+		return;
+	for_each_possible_cpu(cpu)
+		debugfs_remove(cursors[cpu].dentry);
+	kfree(cursors);
+}
 
-	if (buf) {
-		ret = relay_buf_full(buf);
-		if (ret)
-			pr_warn("Provenance: relay (%s) is full.",
-				chan->base_filename);
-		rc += ret;
+static struct prov_cursor *cursors_alloc(const char *name, bool is_long,
+					 const struct prov_channel_opts *opts)
+{
+	struct prov_cursor *cursors;
+	struct prov_cursor *cur;
+	struct prov_ring *ring;
+	char *filename;
+	int cpu;
+
+	cursors = kcalloc(nr_cpu_ids, sizeof(struct prov_cursor), GFP_KERNEL);
+	filename = kzalloc(NAME_MAX + 1, GFP_KERNEL);
+	if (!cursors || !filename) {
+		kfree(cursors);
+		cursors = NULL;
+		goto out;
+	}
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		cur = &cursors[cpu];
+		cur->ring = ring;
+		cur->rb = is_long ? &ring->long_log : &ring->log;
+		cur->varlen = is_long && opts->varlen;
+		cur->compact = !is_long && opts->compact;
+		cur->bit = opts->filter.bit;
+		mutex_init(&cur->lock);
+		// Start from the most recent entry, as a new relay channel would.
+		cur->pos = smp_load_acquire(&cur->rb->head);
+		// Same naming scheme as relay buffer files.
+		snprintf(filename, NAME_MAX + 1, "%s%s%d",
+			 is_long ? "long_" : "", name, cpu);
+		cur->dentry = debugfs_create_file(filename, 0400, NULL, cur,
+						  &cursor_file_operations);
+	}
+out:
+	kfree(filename);
+	return cursors;
+}
+
+static bool channel_exists(const char *name)
+{
+	struct relay_list *tmp;
+	struct cursor_list *cur;
+
+	list_for_each_entry(tmp, &relay_list, list) {
+		if (strcmp(tmp->name, name) == 0)
+			return true;
+	}
+	list_for_each_entry(cur, &cursor_list, list) {
+		if (strcmp(cur->name, name) == 0)
+			return true;
 	}
-	if (rc)
-		return true;
 	return false;
 }
 
 /*!
- * @brief Callback function of function "create_buf_file". This callback
- * function creates relay file in "debugfs".
+ * @brief Publish a log allocated by ring_alloc to the producers.
+ *
+ * The log is written from any context as soon as its data is visible (see
+ * log_append), every other field must be set first.
  */
-static struct dentry *create_buf_file_handler(const char *filename,
-					      struct dentry *parent,
-					      umode_t mode,
-					      struct rchan_buf *buf,
-					      int *is_global)
+static void log_publish(struct prov_ring_buf *log,
+			const struct prov_ring_buf *rb)
 {
-	return debugfs_create_file(filename, mode, parent, buf,
-				   &relay_file_operations);
+	log->seq = rb->seq;
+	log->chans = rb->chans;
+	log->elt_size = rb->elt_size;
+	log->mask = rb->mask;
+	// Pairs with acquire in log_append.
+	smp_store_release(&log->data, rb->data);
 }
 
 /*!
- * @brief Callback function of function "remove_buf_file". This callback
- * function removes the relay file from "debugfs".
+ * @brief Allocate the shared logs of every CPU, the first time a shared
+ * channel is created.
+ *
+ * Logs are allocated on the node of their CPU and never freed: producers
+ * write to them without synchronisation. If an allocation fails, the logs
+ * already published are kept and the others are allocated on the next
+ * attempt.
+ * Called with channel_lock held.
+ * @return 0, -EINVAL if shared logs are disabled (see provenance_log=) or
+ * -ENOMEM.
+ *
  */
-static int remove_buf_file_handler(struct dentry *dentry)
+static int prov_log_alloc(void)
 {
-	debugfs_remove(dentry);
+	static bool allocated;
+	struct prov_ring_buf rb;
+	struct prov_ring *ring;
+	int cpu;
+
+	if (allocated)
+		return 0;
+	// Cursors need at least two slots to tell a busy slot apart.
+	if (!prov_log_enabled() || !prov_ring_wq)
+		return -EINVAL;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(&prov_rings, cpu);
+		if (!ring->log.data) {
+			if (ring_alloc(&rb, prov_log_size,
+				       sizeof(union prov_elt), cpu))
+				return -ENOMEM;
+			log_publish(&ring->log, &rb);
+		}
+		if (!ring->long_log.data) {
+			if (ring_alloc(&rb, prov_long_log_size,
+				       sizeof(union long_prov_elt), cpu))
+				return -ENOMEM;
+			log_publish(&ring->long_log, &rb);
+		}
+	}
+	allocated = true;
+	pr_info("Provenance: shared logs %u/%u entries per cpu.",
+		prov_log_size, prov_long_log_size);
 	return 0;
 }
 
+static int create_cursor_channel(char *name,
+				 const struct prov_channel_opts *opts)
+{
+	struct cursor_list *elt;
+	int rc;
 
-/* Relay interface callback functions */
-static struct rchan_callbacks relay_callbacks = {
-	.create_buf_file = create_buf_file_handler,
-	.remove_buf_file = remove_buf_file_handler,
-};
+	rc = prov_log_alloc();
+	if (rc)
+		return rc;
+	elt = kzalloc(sizeof(struct cursor_list), GFP_KERNEL);
+	if (!elt)
+		return -ENOMEM;
+	elt->name = name;
+	elt->opts = *opts;
+	elt->cursors = cursors_alloc(name, false, opts);
+	elt->long_cursors = cursors_alloc(name, true, opts);
+	if (!elt->cursors || !elt->long_cursors) {
+		// Removing the files waits for the readers of the cursors.
+		cursors_free(elt->cursors);
+		cursors_free(elt->long_cursors);
+		kfree(elt);
+		pr_err("Provenance: could not create channel %s.", name);
+		return -ENOMEM;
+	}
+	list_add_tail(&(elt->list), &cursor_list);
+	return 0;
+}
 
-static void __async_handle_boot_buffer(void *_buf, async_cookie_t cookie)
+/*!
+ * @brief Resolve a relay size against its default and check it.
+ *
+ * Relay needs at least two sub-buffers, each large enough for the largest
+ * encoded entry.
+ * @return 0 or -EINVAL.
+ *
+ */
+static int relay_size_resolve(struct prov_relay_size *size,
+			      const struct prov_relay_size *def,
+			      size_t min)
 {
-	struct list_head *ele, *next;
-	struct boot_buffer *entry;
-	unsigned long irqflags;
-
-	msleep(1000);
-	pr_info("Provenance: async boot buffer task %llu running...", cookie);
+	if (!size->subbuf_size)
+		size->subbuf_size = def->subbuf_size;
+	if (!size->n_subbufs)
+		size->n_subbufs = def->n_subbufs;
+	if (size->subbuf_size < min || size->n_subbufs < 2)
+		return -EINVAL;
+	if (PAGE_ALIGN(size->subbuf_size) > UINT_MAX / size->n_subbufs)
+		return -EINVAL;
+	return 0;
+}
 
-	spin_lock_irqsave(&lock_buffer, irqflags);
-	list_for_each_safe(ele, next, &buffer_list) {
-		entry = list_entry(ele, struct boot_buffer, list);
+/*!
+ * @brief Open the relay buffers of a channel and add it to the relay list.
+ *
+ * Relay allocates the buffer of each CPU from the context opening the
+ * channel (relay_alloc_buf takes no node), so relay pages are not placed on
+ * the node of their CPU; this module does not control that placement. The
+ * record path does not touch them: hooks only write to their CPU staging
+ * ring (allocated on the local node, see ring_alloc), which is moved to
+ * relay by a worker bound to that CPU.
+ * @param name Name of the channel (prepend "long_" for long entries).
+ * @param opts Options of the channel.
+ * @return The new element of the relay list or an error pointer.
+ *
+ */
+static struct relay_list *create_relay_channel(char *name,
+					       const struct prov_channel_opts *opts)
+{
+	char *long_name = kzalloc(PATH_MAX, GFP_KERNEL);
+	struct relay_list *elt = kzalloc(sizeof(struct relay_list), GFP_KERNEL);
+	struct prov_relay_size size = opts->size;
+	struct prov_relay_size long_size = opts->long_size;
+	int rc = 0;
 
-		// check if relay is full
-		if (is_relay_full(prov_chan)) {
-			cookie = async_schedule(__async_handle_boot_buffer,
-						NULL);
-			pr_info("Provenance: schedlued async task %llu.",
-				cookie);
+	if (!long_name || !elt) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	rc = relay_size_resolve(&size, &prov_relay_size,
+				max_t(size_t, sizeof(union prov_elt),
+				      sizeof(struct prov_compact_header)
+				      + PROV_COMPACT_MAX));
+	if (rc)
+		goto out;
+	rc = relay_size_resolve(&long_size, &prov_long_relay_size,
+				sizeof(struct prov_long_header)
+				+ sizeof(union long_prov_elt) + 8);
+	if (rc)
+		goto out;
+	elt->name = name;
+	elt->varlen = opts->varlen;
+	elt->compact = opts->compact;
+	elt->bit = opts->filter.bit;
+	if (elt->compact) {
+		elt->compact_state = alloc_percpu(struct prov_compact_state);
+		if (!elt->compact_state) {
+			rc = -ENOMEM;
 			goto out;
 		}
-
-		// tighten provenance entry
-		tighten_identifier(&get_prov_identifier(&(entry->msg)));
-		if (prov_is_relation(&(entry->msg))) {
-			tighten_identifier(&(entry->msg.relation_info.snd));
-			tighten_identifier(&(entry->msg.relation_info.rcv));
-		}
-
-		relay_write(prov_chan, &(entry->msg), sizeof(union prov_elt));
-
-		list_del(&(entry->list));
-		kmem_cache_free(boot_buffer_cache, entry);
 	}
-	pr_info("Provenance: finished task %llu.", cookie);
+	snprintf(long_name, PATH_MAX, "long_%s", name);
+	// Only the regular buffers need the element, see subbuf_start_handler.
+	elt->prov = relay_open(name, NULL, size.subbuf_size, size.n_subbufs,
+			       &relay_callbacks, elt);
+	if (!elt->prov) {
+		rc = -EFAULT;
+		goto out;
+	}
+	elt->long_prov = relay_open(long_name, NULL,
+				    long_size.subbuf_size,
+				    long_size.n_subbufs,
+				    &relay_callbacks,
+				    NULL);
+	if (!elt->long_prov) {
+		relay_close(elt->prov);
+		rc = -EFAULT;
+		goto out;
+	}
+	list_add_tail_rcu(&(elt->list), &relay_list);
 out:
-	spin_unlock_irqrestore(&lock_buffer, irqflags);
+	kfree(long_name);
+	if (rc) {
+		if (elt)
+			free_percpu(elt->compact_state);
+		kfree(elt);
+		return ERR_PTR(rc);
+	}
+	return elt;
 }
 
-static void __async_handle_long_boot_buffer(void *_buf, async_cookie_t cookie)
-{
-	struct list_head *ele, *next;
-	struct long_boot_buffer *entry;
-	unsigned long irqflags;
+static const char * const relation_category_names[] = {
+	"associated", "influenced", "informed", "used", "generated", "derived",
+};
 
-	msleep(1000);
-	pr_info("Provenance: async long boot buffer task %llu running...",
-		cookie);
+#define filter_ns_opt(f, opt, val, field)				\
+	do {								\
+		if (strcmp(opt, #field) == 0) {				\
+			(f)->has_ns = true;				\
+			return kstrtou32(val, 0, &(f)->field);		\
+		}							\
+	} while (0)
 
-	spin_lock_irqsave(&lock_long_buffer, irqflags);
-	list_for_each_safe(ele, next, &long_buffer_list) {
-		entry = list_entry(ele, struct long_boot_buffer, list);
+/*!
+ * @brief Parse a channel filter option, see parse_channel_opts.
+ * @return 0 or -EINVAL if the option is not a filter option.
+ */
+static int parse_filter_opt(const char *opt, const char *val,
+			    struct prov_channel_filter *f)
+{
+	uint64_t mask;
+	int i;
 
-		// check if relay is full
-		if (is_relay_full(prov_chan)) {
-			cookie = async_schedule(__async_handle_long_boot_buffer,
-						NULL);
-			pr_info("Provenance: schedlued long async task %llu.",
-				cookie);
-			goto out;
+	filter_ns_opt(f, opt, val, utsns);
+	filter_ns_opt(f, opt, val, ipcns);
+	filter_ns_opt(f, opt, val, pidns);
+	filter_ns_opt(f, opt, val, netns);
+	filter_ns_opt(f, opt, val, cgroupns);
+	if (kstrtou64(val, 0, &mask))
+		return -EINVAL;
+	if (strcmp(opt, "nodes") == 0) {
+		f->has_type = true;
+		f->node_mask |= mask;
+		return 0;
+	}
+	for (i = 0; i < PROV_RELATION_CATEGORIES; i++) {
+		if (strcmp(opt, relation_category_names[i]) == 0) {
+			f->has_type = true;
+			f->relation_mask[i] |= mask;
+			return 0;
 		}
-
-		// tighten provenance entry
-		tighten_identifier(&get_prov_identifier(&(entry->msg)));
-
-		relay_write(long_prov_chan, &(entry->msg),
-			    sizeof(union long_prov_elt));
-
-		list_del(&(entry->list));
-		kmem_cache_free(long_boot_buffer_cache, entry);
 	}
-	pr_info("Provenance: finished task %llu.", cookie);
-out:
-	spin_unlock_irqrestore(&lock_long_buffer, irqflags);
+	return -EINVAL;
 }
 
-bool relay_ready;
-static bool relay_initialized;
 /*!
- * @brief Write whatever in boot buffer to relay buffer when relay buffer is
- * ready.
+ * @brief Parse the options following a channel name.
  *
- * This function writes what's in boot_buffer to relay buffer for regular
- * provenance entries,
- * and what's in long_boot_buffer to relay buffer for long provenance entries.
- * It also frees memory after it is done writing.
- * Once done, set boolean value relay_ready to true to signal that relay buffer
- * is ready to be used.
+ * Options are space separated "key=value" pairs:
+ * "compact=<0|1>" regular entries are written as a compact stream;
+ * "varlen=<0|1>" long entries are written in variable-length form;
+ * "shared=<0|1>" the channel reads the per-CPU shared logs through cursors
+ * instead of owning relay buffers (see prov_create_channel);
+ * "subbuf_size=<size>" and "nb_subbuf=<count>" set the per-CPU relay buffer
+ * for regular entries (sizes accept the K, M and G suffixes);
+ * "long_subbuf_size=<size>" and "long_nb_subbuf=<count>" do the same for
+ * long entries;
+ * "nodes=<mask>" and "<category>=<mask>" (i.e., derived, generated, used,
+ * informed, influenced and associated) restrict the channel to the node
+ * and relation types whose subtype bits hit the masks (a category without
+ * mask gets no relation);
+ * "<ns>=<inum>" (i.e., utsns, ipcns, pidns, netns and cgroupns) restrict
+ * the channel to entries recorded by tasks in those namespaces.
+ * Masks and namespaces are repeatable, masks accumulate.
+ * @param options The options string.
+ * @param opts Options to be updated.
+ * @return 0 or -EINVAL if an option is not recognised.
  *
  */
-void write_boot_buffer(void)
+static int parse_channel_opts(char *options, struct prov_channel_opts *opts)
 {
-	async_cookie_t cookie;
-
-	if (prov_machine_id == 0 || prov_boot_id == 0 || !relay_initialized)
-		return;
-
-	relay_ready = true;
-
-	refresh_prov_machine();
-	relay_write(long_prov_chan, prov_machine, sizeof(union long_prov_elt));
-
-	// asynchronously empty the buffer
-	if (!list_empty(&buffer_list)) {
-		cookie = async_schedule(__async_handle_boot_buffer, NULL);
-		pr_info("Provenance: schedlued async task %llu.",
-			cookie);
-	}
+	unsigned long n;
+	char *opt;
+	char *val;
+	char *end;
 
-	// asynchronously empty the buffer
-	if (!list_empty(&long_buffer_list)) {
-		cookie = async_schedule(__async_handle_long_boot_buffer, NULL);
-		pr_info("Provenance: schedlued long async task %llu.", cookie);
+	while ((opt = strsep(&options, " \t\n")) != NULL) {
+		if (!*opt)
+			continue;
+		val = strchr(opt, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+		if (strcmp(opt, "compact") == 0) {
+			if (kstrtobool(val, &opts->compact))
+				return -EINVAL;
+		} else if (strcmp(opt, "varlen") == 0) {
+			if (kstrtobool(val, &opts->varlen))
+				return -EINVAL;
+		} else if (strcmp(opt, "shared") == 0) {
+			if (kstrtobool(val, &opts->shared))
+				return -EINVAL;
+			opts->shared_set = true;
+		} else if (strcmp(opt, "subbuf_size") == 0) {
+			opts->size.subbuf_size = memparse(val, &end);
+			if (*end)
+				return -EINVAL;
+		} else if (strcmp(opt, "nb_subbuf") == 0) {
+			if (kstrtoul(val, 0, &n))
+				return -EINVAL;
+			opts->size.n_subbufs = n;
+		} else if (strcmp(opt, "long_subbuf_size") == 0) {
+			opts->long_size.subbuf_size = memparse(val, &end);
+			if (*end)
+				return -EINVAL;
+		} else if (strcmp(opt, "long_nb_subbuf") == 0) {
+			if (kstrtoul(val, 0, &n))
+				return -EINVAL;
+			opts->long_size.n_subbufs = n;
+		} else if (parse_filter_opt(opt, val, &opts->filter))
+			return -EINVAL;
 	}
+	return 0;
 }
 
 /*!
- * @brief Create a provenance relay buffer channel for both regular and long
- * provenance entries.
+ * @brief Create a provenance channel for both regular and long provenance
+ * entries.
  *
- * Each relay channel in the list must have a unique name.
- * Each relay channel contains a relay buffer for regular provenance entries and
- * a relay buffer for long provenance entries.
- * @param buffer Contains the name of the relay buffer for regular provenance
- * entries (prepend "long_" for the relay buffer name for long provenance
- * entries)
- * @param len The length of the name of the regular relay buffer.
- * @return 0 if no error occurred; -EFAULT if name already exists for relay
- * buffer or opening new relay buffer failed; -ENOMEM if length of the name of
- * the relay buffer is too long. Other error codes unknown.
+ * Each channel in the list must have a unique name.
+ * The name may be followed by options (see parse_channel_opts), which
+ * default to the options of the base channel.
+ * By default, the channel is a set of read cursors over the per-CPU shared
+ * logs: entries are written to the logs once whatever the number of
+ * channels, and a channel costs no relay memory. The logs are sized by
+ * provenance_log= and are not recycled by the relay drain; a channel falling
+ * more than a log behind loses entries (counted in "lost").
+ * Its files are named as relay files would be (i.e., <name><cpu> and
+ * long_<name><cpu>) and support read and poll.
+ * With "shared=0", with relay sizes, or when shared logs are disabled, a
+ * relay channel containing a relay buffer for regular provenance entries
+ * and a relay buffer for long provenance entries is created instead, and
+ * every entry is copied into it.
+ * A channel with a filter only gets the entries that pass it, the filter is
+ * evaluated once per entry when it is recorded (see channel_mask).
+ * @param buffer Contains the name of the channel for regular provenance
+ * entries (prepend "long_" for the channel for long provenance entries)
+ * followed by options.
+ * @param len The length of the buffer.
+ * @return 0 if no error occurred; -EFAULT if name already exists for channel
+ * or opening new relay buffer failed; -ENOMEM if length of the name of
+ * the channel is too long or allocation failed; -EINVAL if an option is
+ * invalid (or "shared=1" is given with relay sizes or while shared logs are
+ * disabled). Other error codes unknown.
  *
  */
 int prov_create_channel(char *buffer, size_t len)
 {
-	struct relay_list *tmp;
-	char *long_name = kzalloc(PATH_MAX, GFP_KERNEL);
-	struct rchan *chan;
-	struct rchan *long_chan;
+	struct prov_channel_opts opts = {
+		.varlen = prov_long_varlen,
+		.compact = prov_compact,
+	};
+	struct prov_channel_filter *filter = NULL;
+	struct relay_list *elt;
+	bool has_size;
+	char *name;
 	int rc = 0;
 
+	name = strsep(&buffer, " \t\n");
+	if (!*name)
+		return -EINVAL;
+	// Leave room for the "long_" prefix and the CPU number.
+	if (strlen(name) > PROV_CHANNEL_NAME_LEN - 16)
+		return -ENOMEM;
+	rc = parse_channel_opts(buffer, &opts);
+	if (rc)
+		return rc;
+	has_size = opts.size.subbuf_size || opts.size.n_subbufs
+		   || opts.long_size.subbuf_size || opts.long_size.n_subbufs;
+	if (!opts.shared_set)
+		opts.shared = prov_log_enabled() && !has_size;
+	else if (opts.shared && (has_size || !prov_log_enabled()))
+		return -EINVAL;
+	mutex_lock(&channel_lock);
 	// Test if channel already exists based on the name.
-	list_for_each_entry(tmp, &relay_list, list) {
-		if (strcmp(tmp->name, buffer) == 0) {
-			rc = -EFAULT;
+	if (channel_exists(name)) {
+		rc = -EFAULT;
+		goto out;
+	}
+	if (opts.filter.has_type || opts.filter.has_ns) {
+		if (filter_bits == PROV_ALL_CHANNELS) {
+			rc = -ENOSPC;
+			goto out;
+		}
+		opts.filter.bit = 1ULL << ffz(filter_bits);
+		filter = kmemdup(&opts.filter, sizeof(struct prov_channel_filter),
+				 GFP_KERNEL);
+		if (!filter) {
+			rc = -ENOMEM;
 			goto out;
 		}
+		// Published first, entries recorded from now on are filtered.
+		filter_bits |= filter->bit;
+		list_add_tail_rcu(&filter->list, &filter_list);
 	}
-	if (len > PATH_MAX - 5) {
+	name = kstrdup(name, GFP_KERNEL);
+	if (!name) {
 		rc = -ENOMEM;
-		goto out;
+		goto unpublish;
 	}
-	snprintf(long_name, PATH_MAX, "long_%s", buffer);
-	chan = relay_open(buffer, NULL, PROV_RELAY_BUFF_SIZE, PROV_NB_SUBBUF,
-			  &relay_callbacks, NULL);
-	if (!chan) {
-		rc = -EFAULT;
-		goto out;
+	if (opts.shared)
+		rc = create_cursor_channel(name, &opts);
+	else {
+		elt = create_relay_channel(name, &opts);
+		if (IS_ERR(elt))
+			rc = PTR_ERR(elt);
 	}
-	long_chan = relay_open(long_name, NULL,
-			       PROV_RELAY_BUFF_SIZE,
-			       PROV_NB_SUBBUF,
-			       &relay_callbacks,
-			       NULL);
-	if (!long_chan) {
-		rc = -EFAULT;
-		goto out;
+	if (rc)
+		kfree(name);
+	else
+		prov_intern_flush(); // The new channel has seen no interned path.
+unpublish:
+	if (rc && filter) {
+		list_del_rcu(&filter->list);
+		synchronize_rcu();
+		filter_bits &= ~filter->bit;
+		kfree(filter);
 	}
-	prov_add_relay(buffer, chan, long_chan);
 out:
-	kfree(long_name);
+	mutex_unlock(&channel_lock);
+	return rc;
+}
+
+/*!
+ * @brief Fill channel information, one entry per channel.
+ * @param info Array to be filled.
+ * @param nr Number of entries in the array.
+ * @return Number of entries filled.
+ *
+ */
+size_t prov_channel_info(struct prov_channel_info *info, size_t nr)
+{
+	struct relay_list *tmp;
+	struct cursor_list *cur;
+	size_t i = 0;
+	int cpu;
+
+	mutex_lock(&channel_lock);
+	list_for_each_entry(tmp, &relay_list, list) {
+		if (i >= nr)
+			goto out;
+		memset(&info[i], 0, sizeof(struct prov_channel_info));
+		strlcpy(info[i].name, tmp->name, PROV_CHANNEL_NAME_LEN);
+		info[i].varlen = tmp->varlen;
+		info[i].compact = tmp->compact;
+		info[i].lost = atomic64_read(&tmp->lost);
+		info[i].long_lost = atomic64_read(&tmp->long_lost);
+		info[i].subbuf_size = tmp->prov->subbuf_size;
+		info[i].nb_subbuf = tmp->prov->n_subbufs;
+		info[i].long_subbuf_size = tmp->long_prov->subbuf_size;
+		info[i].long_nb_subbuf = tmp->long_prov->n_subbufs;
+		info[i].filtered = tmp->bit != 0;
+		i++;
+	}
+	list_for_each_entry(cur, &cursor_list, list) {
+		if (i >= nr)
+			goto out;
+		memset(&info[i], 0, sizeof(struct prov_channel_info));
+		strlcpy(info[i].name, cur->name, PROV_CHANNEL_NAME_LEN);
+		info[i].shared = 1;
+		info[i].varlen = cur->opts.varlen;
+		info[i].compact = cur->opts.compact;
+		info[i].filtered = cur->opts.filter.bit != 0;
+		for_each_possible_cpu(cpu) {
+			info[i].lost += READ_ONCE(cur->cursors[cpu].lost);
+			info[i].long_lost += READ_ONCE(cur->long_cursors[cpu].lost);
+		}
+		i++;
+	}
+out:
+	mutex_unlock(&channel_lock);
+	return i;
+}
+
+/*!
+ * @brief Whether the current context may wait for room under
+ * PROV_OVERFLOW_THROTTLE.
+ *
+ * Without CONFIG_PREEMPT_COUNT atomic contexts cannot be told apart, and
+ * nothing waits.
+ */
+static __always_inline bool overflow_can_wait(void)
+{
+	return READ_ONCE(prov_overflow.mode) == PROV_OVERFLOW_THROTTLE
+	       && in_task() && preemptible() && !rcu_preempt_depth();
+}
+
+static __always_inline bool ring_allocated(bool is_long)
+{
+	struct prov_ring *ring = raw_cpu_ptr(&prov_rings);
+
+	if (is_long)
+		return ring->long_buf.data != NULL;
+	return ring->buf.data != NULL;
+}
+
+static bool relay_room(bool is_long, size_t size, uint64_t chans)
+{
+	bool rc;
+
+	preempt_disable();
+	rc = relay_fits_all(is_long, size, chans);
+	preempt_enable();
 	return rc;
 }
 
+static __always_inline bool ring_busy(struct prov_ring *ring)
+{
+	return READ_ONCE(ring->stalled)
+	       || (ring->buf.data
+		   && ring_depth(&ring->buf) > ring->buf.mask / 2)
+	       || (ring->long_buf.data
+		   && ring_depth(&ring->long_buf) > ring->long_buf.mask / 2);
+}
 
-static void insert_boot_buffer(union prov_elt *msg)
+/*!
+ * @brief Wait for the staging rings of the current CPU to drain under
+ * PROV_OVERFLOW_THROTTLE (see prov_throttle).
+ *
+ * Entries are written with node locks held, where nothing can wait (see
+ * prov_stage). Hooks instead throttle before taking any provenance lock:
+ * a context that can sleep waits up to "wait_ms" while a ring of its CPU is
+ * more than half full or its drain is held back by a full relay buffer.
+ */
+void __prov_throttle(void)
 {
-	struct boot_buffer *tmp = kmem_cache_zalloc(boot_buffer_cache,
-						    GFP_ATOMIC);
-	unsigned long irqflags;
+	unsigned long deadline;
+
+	if (!overflow_can_wait())
+		return;
+	deadline = jiffies + msecs_to_jiffies(READ_ONCE(prov_overflow.wait_ms));
+	while (ring_busy(raw_cpu_ptr(&prov_rings))
+	       && time_before(jiffies, deadline))
+		schedule_timeout_uninterruptible(1);
+}
+
+/*!
+ * @brief Hand an entry over to relay, through the staging ring if possible.
+ *
+ * When the ring is full (or disabled), see ring_overflow.
+ * Under PROV_OVERFLOW_THROTTLE, the rare callers that can sleep (i.e., that
+ * hold no provenance lock) first wait up to "wait_ms" for room in the ring
+ * (or in relay when there is no ring); other callers rely on prov_throttle.
+ * Entries relay cannot take are dropped and counted (see prov_drop_info).
+ */
+static void prov_stage(bool is_long, void *msg, size_t size)
+{
+	uint64_t chans = channel_mask(msg);
+	unsigned long deadline;
 
-	__memcpy_ss(&(tmp->msg), sizeof(union prov_elt),
-		    msg, sizeof(union prov_elt));
-	INIT_LIST_HEAD(&(tmp->list));
-	spin_lock_irqsave(&lock_buffer, irqflags);
-	list_add(&(tmp->list), &buffer_list);
-	spin_unlock_irqrestore(&lock_buffer, irqflags);
+	if (likely(ring_enqueue(is_long, msg, size, chans)))
+		return;
+	deadline = jiffies + msecs_to_jiffies(READ_ONCE(prov_overflow.wait_ms));
+	while (overflow_can_wait() && time_before(jiffies, deadline)) {
+		if (!ring_allocated(is_long) && relay_room(is_long, size, chans))
+			break;
+		schedule_timeout_uninterruptible(1);
+		if (ring_enqueue(is_long, msg, size, chans))
+			return;
+	}
+	ring_overflow(is_long, msg, size, chans);
 }
 
 /*!
@@ -329,17 +2600,14 @@ static void insert_boot_buffer(union prov_elt *msg)
  *
  * If in an unlikely event that relay is not ready, provenance information
  * should be written to the boot buffer.
- * However, in an unlikely event that the boot buffer is full, an error is
- * thrown.
- * Otherwise (i.e., boot buffer is not full) provenance information is written
- * to the next empty slot in the boot buffer.
- * If relay buffer is ready, write to relay buffer.
- * It will write to every relay buffer in the relay_list for every CamQuery
- * query use.
- * This is because once provenance is read from a relay buffer, it will be
- * consumed from the buffer.
- * We therefore need to write to multiple relay buffers if we want to
- * consume/use same provenance data multiple times.
+ * The boot buffer is per CPU and preserves order; in the unlikely event
+ * that it is full, the entry is counted as boot overflow.
+ * If relay buffer is ready, the entry is staged in the per-CPU ring and
+ * written to relay asynchronously (see prov_ring_drain).
+ * If the ring is full, the oldest staged entry is written to relay
+ * synchronously to make room, so that no provenance is lost on relay
+ * channels and order is preserved (counted as overflow, see struct
+ * prov_ring_info), subject to the overflow policy (see prov_stage).
  * @param msg Provenance information to be written to either boot buffer or
  * relay buffer.
  * @return NULL
@@ -347,33 +2615,13 @@ static void insert_boot_buffer(union prov_elt *msg)
  */
 void prov_write(union prov_elt *msg, size_t size)
 {
-	struct relay_list *tmp;
-
 	BUG_ON(prov_type_is_long(prov_type(msg)));
 
 	prov_jiffies(msg) = get_jiffies_64();
-	if (unlikely(!relay_ready))
-		insert_boot_buffer(msg);
-	else {
-		prov_written = true;
-		list_for_each_entry(tmp, &relay_list, list) {
-			relay_write(tmp->prov, msg, size);
-		}
-	}
-}
-
-static void insert_long_boot_buffer(union long_prov_elt *msg)
-{
-	struct long_boot_buffer *tmp = kmem_cache_zalloc(long_boot_buffer_cache,
-							 GFP_ATOMIC);
-	unsigned long irqflags;
-
-	__memcpy_ss(&(tmp->msg), sizeof(union long_prov_elt),
-		    msg, sizeof(union long_prov_elt));
-	INIT_LIST_HEAD(&(tmp->list));
-	spin_lock_irqsave(&lock_long_buffer, irqflags);
-	list_add(&(tmp->list), &long_buffer_list);
-	spin_unlock_irqrestore(&lock_long_buffer, irqflags);
+	if (unlikely(!relay_ready) && insert_boot_buffer(false, msg, size))
+		return;
+	prov_written = true;
+	prov_stage(false, msg, size);
 }
 
 /*!
@@ -389,19 +2637,13 @@ static void insert_long_boot_buffer(union long_prov_elt *msg)
  */
 void long_prov_write(union long_prov_elt *msg, size_t size)
 {
-	struct relay_list *tmp;
-
 	BUG_ON(!prov_type_is_long(prov_type(msg)));
 
 	prov_jiffies(msg) = get_jiffies_64();
-	if (unlikely(!relay_ready))
-		insert_long_boot_buffer(msg);
-	else {
-		prov_written = true;
-		list_for_each_entry(tmp, &relay_list, list) {
-			relay_write(tmp->long_prov, msg, size);
-		}
-	}
+	if (unlikely(!relay_ready) && insert_boot_buffer(true, msg, size))
+		return;
+	prov_written = true;
+	prov_stage(true, msg, size);
 }
 
 /*!
@@ -418,19 +2660,28 @@ void long_prov_write(union long_prov_elt *msg, size_t size)
  */
 static __init int relay_prov_init(void)
 {
-	prov_chan = relay_open(PROV_BASE_NAME, NULL, PROV_RELAY_BUFF_SIZE,
-			       PROV_NB_SUBBUF, &relay_callbacks, NULL);
-	if (!prov_chan)
-		panic("Provenance: relay_open failure\n");
+	struct prov_channel_opts opts = {
+		.varlen = prov_long_varlen,
+		.compact = prov_compact,
+	};
+	struct relay_list *elt;
 
-	long_prov_chan = relay_open(LONG_PROV_BASE_NAME, NULL,
-				    PROV_RELAY_BUFF_SIZE,
-				    PROV_NB_SUBBUF,
-				    &relay_callbacks,
-				    NULL);
-	if (!long_prov_chan)
+	prov_relay_file_operations = relay_file_operations;
+	prov_relay_file_operations.read = relay_file_read_handler;
+	prov_relay_file_operations.splice_read = relay_file_splice_read_handler;
+	elt = create_relay_channel(PROV_BASE_NAME, &opts);
+	if (PTR_ERR(elt) == -EINVAL) {
+		pr_err("Provenance: invalid relay size, using default.");
+		prov_relay_size.subbuf_size = PROV_RELAY_BUFF_SIZE;
+		prov_relay_size.n_subbufs = PROV_NB_SUBBUF;
+		prov_long_relay_size = prov_relay_size;
+		elt = create_relay_channel(PROV_BASE_NAME, &opts);
+	}
+	if (IS_ERR(elt))
 		panic("Provenance: relay_open failure\n");
-	prov_add_relay(PROV_BASE_NAME, prov_chan, long_prov_chan);
+	prov_chan = elt->prov;
+	long_prov_chan = elt->long_prov;
+	prov_ring_init();
 	relay_initialized = true;
 	init_prov_machine();
 	write_boot_buffer();
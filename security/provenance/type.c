@@ -95,6 +95,7 @@ static const char RL_STR_TERMINATE_PROC[] = "terminate_proc";
 static const char RL_STR_FREED[] = "free";                                                              // created when an inode is freed
 static const char RL_STR_ARG[] = "arg";                                                                 // connect arg value to process
 static const char RL_STR_ENV[] = "env";                                                                 // connect env value to process
+static const char RL_STR_ARGS[] = "args";                                                               // connect packed args and env to process
 static const char RL_STR_LOG[] = "log";                                                                 // connect string to task
 static const char RL_STR_SH_ATTACH_READ[] = "sh_attach_read";                                           // attach sh with read perm
 static const char RL_STR_SH_ATTACH_WRITE[] = "sh_attach_write";                                         // attach sh with write perm
@@ -151,6 +152,7 @@ static const char ND_STR_XATTR[] = "xattr";
 static const char ND_STR_PCKCNT[] = "packet_content";                           // the content of network packet
 static const char ND_STR_ARG[] = "argv";                                        // argument passed to a process
 static const char ND_STR_ENV[] = "envp";                                        // environment parameter
+static const char ND_STR_ARGS[] = "argv_envp";                                  // packed arguments and environment
 static const char ND_STR_PROC[] = "process_memory";                             // process memory
 
 #define MATCH_AND_RETURN(str1, str2, v)	\
@@ -317,6 +319,8 @@ const char *relation_str(uint64_t type)
 		return RL_STR_ARG;
 	case RL_ENV:
 		return RL_STR_ENV;
+	case RL_ARGS:
+		return RL_STR_ARGS;
 	case RL_LOG:
 		return RL_STR_LOG;
 	case RL_SH_ATTACH_READ:
@@ -461,6 +465,7 @@ uint64_t relation_id(const char *str)
 	MATCH_AND_RETURN(str, RL_STR_FREED, RL_FREED);
 	MATCH_AND_RETURN(str, RL_STR_ARG, RL_ARG);
 	MATCH_AND_RETURN(str, RL_STR_ENV, RL_ENV);
+	MATCH_AND_RETURN(str, RL_STR_ARGS, RL_ARGS);
 	MATCH_AND_RETURN(str, RL_STR_LOG, RL_LOG);
 	MATCH_AND_RETURN(str, RL_STR_SH_ATTACH_READ, RL_SH_ATTACH_READ);
 	MATCH_AND_RETURN(str, RL_STR_SH_ATTACH_WRITE, RL_SH_ATTACH_WRITE);
@@ -549,6 +554,8 @@ const char *node_str(uint64_t type)
 		return ND_STR_ARG;
 	case ENT_ENV:
 		return ND_STR_ENV;
+	case ENT_ARGS:
+		return ND_STR_ARGS;
 	case ENT_PROC:
 		return ND_STR_PROC;
 	default:
@@ -584,6 +591,7 @@ uint64_t node_id(const char *str)
 	MATCH_AND_RETURN(str, ND_STR_PCKCNT, ENT_PCKCNT);
 	MATCH_AND_RETURN(str, ND_STR_ARG, ENT_ARG);
 	MATCH_AND_RETURN(str, ND_STR_ENV, ENT_ENV);
+	MATCH_AND_RETURN(str, ND_STR_ARGS, ENT_ARGS);
 	MATCH_AND_RETURN(str, ND_STR_PROC, ENT_PROC);
 	return 0;
 }